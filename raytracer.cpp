@@ -8,6 +8,23 @@
 #include <random>
 #include <memory>
 #include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <map>
+#include <climits>
+#include <cstring>
+#include <mutex>
+#include <sstream>
+#include <fstream>
+#include <sys/stat.h>
+#include <new>
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
 
 // Vector and math classes
 struct Vec3 {
@@ -18,6 +35,8 @@ struct Vec3 {
     Vec3 operator+(const Vec3& v) const { return Vec3(x + v.x, y + v.y, z + v.z); }
     Vec3 operator-(const Vec3& v) const { return Vec3(x - v.x, y - v.y, z - v.z); }
     Vec3 operator*(float s) const { return Vec3(x * s, y * s, z * s); }
+    bool operator==(const Vec3& v) const { return x == v.x && y == v.y && z == v.z; }
+    bool operator!=(const Vec3& v) const { return !(*this == v); }
     float dot(const Vec3& v) const { return x * v.x + y * v.y + z * v.z; }
     Vec3 cross(const Vec3& v) const { 
         return Vec3(y * v.z - z * v.y, z * v.x - x * v.z, x * v.y - y * v.x); 
@@ -47,10 +66,155 @@ struct Color {
     Color clamp() const { return Color(std::min(1.0f, r), std::min(1.0f, g), std::min(1.0f, b)); }
 };
 
+// Storage for large arrays. Everything is aligned to a cache line, so arrays that render
+// workers write side by side start on a line boundary. Arrays of 2 MB or more get 2 MB
+// alignment and are marked for transparent huge pages, which cuts TLB misses when
+// traversal and per-pixel passes sweep them. madvise is only a hint, and other platforms
+// get plain aligned memory.
+constexpr size_t kCacheLine = 64;
+constexpr size_t kHugePage = size_t(2) << 20;
+
+inline void* allocateAligned(size_t bytes) {
+#ifdef __linux__
+    if (bytes >= kHugePage) {
+        size_t rounded = (bytes + kHugePage - 1) / kHugePage * kHugePage;
+        void* p = nullptr;
+        if (posix_memalign(&p, kHugePage, rounded) != 0) throw std::bad_alloc();
+        madvise(p, rounded, MADV_HUGEPAGE);
+        return p;
+    }
+#endif
+    return ::operator new(bytes, std::align_val_t(kCacheLine));
+}
+
+inline void freeAligned(void* p, size_t bytes) {
+#ifdef __linux__
+    if (bytes >= kHugePage) {
+        free(p);
+        return;
+    }
+#endif
+    ::operator delete(p, std::align_val_t(kCacheLine));
+}
+
+// Memory accounting. Every AlignedAllocator is tagged with the subsystem it serves, and
+// memoryStats() keeps live and peak bytes per tag. A tag may have a budget (--memory-budget):
+// caches size their tables to fit it and textures drop mip levels when over it; for the
+// other tags it is only flagged in the report.
+enum class MemoryTag { Frame, Texture, Accel, Cache, Count };
+
+inline const char* memoryTagName(MemoryTag tag) {
+    switch (tag) {
+        case MemoryTag::Frame: return "frame";
+        case MemoryTag::Texture: return "texture";
+        case MemoryTag::Accel: return "accel";
+        case MemoryTag::Cache: return "cache";
+        default: return "?";
+    }
+}
+
+struct MemoryStats {
+    static constexpr int kTags = (int)MemoryTag::Count;
+    
+    std::atomic<int64_t> live[kTags] = {};
+    std::atomic<int64_t> peak[kTags] = {};
+    int64_t budget[kTags] = {};   // Bytes, 0 for none; set before any tracer is created
+    
+    void add(MemoryTag tag, int64_t bytes) {
+        int i = (int)tag;
+        int64_t now = live[i].fetch_add(bytes, std::memory_order_relaxed) + bytes;
+        int64_t high = peak[i].load(std::memory_order_relaxed);
+        while (now > high && !peak[i].compare_exchange_weak(high, now, std::memory_order_relaxed)) {}
+    }
+    
+    void remove(MemoryTag tag, int64_t bytes) { live[(int)tag].fetch_sub(bytes, std::memory_order_relaxed); }
+    
+    int64_t bytes(MemoryTag tag) const { return live[(int)tag].load(std::memory_order_relaxed); }
+    int64_t limit(MemoryTag tag) const { return budget[(int)tag]; }
+    bool overBudget(MemoryTag tag) const { return limit(tag) > 0 && bytes(tag) > limit(tag); }
+    
+    int64_t total() const {
+        int64_t sum = 0;
+        for (int i = 0; i < kTags; ++i) sum += live[i].load(std::memory_order_relaxed);
+        return sum;
+    }
+    
+    // "TAG=MB" from the command line; false for an unknown tag or a malformed size
+    bool setBudget(const std::string& spec) {
+        size_t eq = spec.find('=');
+        if (eq == std::string::npos) return false;
+        double mb = atof(spec.c_str() + eq + 1);
+        if (mb <= 0.0) return false;
+        for (int i = 0; i < kTags; ++i) {
+            if (spec.compare(0, eq, memoryTagName((MemoryTag)i)) == 0) {
+                budget[i] = (int64_t)(mb * (1 << 20));
+                return true;
+            }
+        }
+        return false;
+    }
+    
+    // One line per tag: live, peak and budget in MB, with a mark on tags over budget
+    std::string report() const {
+        std::ostringstream out;
+        out.setf(std::ios::fixed);
+        out.precision(1);
+        auto mb = [](int64_t bytes) { return bytes / double(1 << 20); };
+        for (int i = 0; i < kTags; ++i) {
+            MemoryTag tag = (MemoryTag)i;
+            out << "  " << memoryTagName(tag) << ": " << mb(bytes(tag)) << " MB (peak " << mb(peak[i].load()) << " MB";
+            if (limit(tag) > 0) out << ", budget " << mb(limit(tag)) << " MB" << (overBudget(tag) ? ", OVER" : "");
+            out << ")\n";
+        }
+        out << "  total: " << mb(total()) << " MB";
+        return out.str();
+    }
+};
+
+inline MemoryStats& memoryStats() {
+    static MemoryStats stats;
+    return stats;
+}
+
+// Largest table of 2^n cells, n <= max_log2, fitting in budget bytes (0 for no budget).
+// Tables never go below 2^10 cells.
+inline int fitTableLog2(size_t cell_bytes, int64_t budget, int max_log2) {
+    int n = max_log2;
+    while (budget > 0 && n > 10 && (int64_t)(cell_bytes << n) > budget) --n;
+    return n;
+}
+
+template <typename T, MemoryTag Tag>
+struct AlignedAllocator {
+    using value_type = T;
+    template <typename U> struct rebind { using other = AlignedAllocator<U, Tag>; };
+    
+    AlignedAllocator() = default;
+    template <typename U> AlignedAllocator(const AlignedAllocator<U, Tag>&) {}
+    
+    T* allocate(size_t n) {
+        T* p = static_cast<T*>(allocateAligned(n * sizeof(T)));
+        memoryStats().add(Tag, n * sizeof(T));
+        return p;
+    }
+    
+    void deallocate(T* p, size_t n) {
+        freeAligned(p, n * sizeof(T));
+        memoryStats().remove(Tag, n * sizeof(T));
+    }
+    
+    template <typename U> bool operator==(const AlignedAllocator<U, Tag>&) const { return true; }
+    template <typename U> bool operator!=(const AlignedAllocator<U, Tag>&) const { return false; }
+};
+
+template <typename T, MemoryTag Tag>
+using AlignedVector = std::vector<T, AlignedAllocator<T, Tag>>;
+
 // Texture class for texture mapping
 struct Texture {
-    std::vector<Color> data;
+    AlignedVector<Color, MemoryTag::Texture> data;
     int width, height;
+    std::vector<AlignedVector<Color, MemoryTag::Texture>> mips; // Box-filtered levels 1..n, each half the previous size
     
     Texture(int w, int h) : width(w), height(h), data(w * h) {
         // Create checkerboard pattern
@@ -60,6 +224,77 @@ struct Texture {
                 data[y * width + x] = checker ? Color(0.8f, 0.8f, 0.8f) : Color(0.2f, 0.2f, 0.2f);
             }
         }
+        buildMips();
+    }
+    
+    Texture(int w, int h, AlignedVector<Color, MemoryTag::Texture> texels) : data(std::move(texels)), width(w), height(h) {
+        buildMips();
+    }
+    
+    // Binary 8-bit PPM (P6); null when the file is missing or malformed
+    static std::shared_ptr<Texture> loadPPM(const std::string& path) {
+        std::ifstream file(path, std::ios::binary);
+        auto header = [&file](int& value) {
+            file >> std::ws;
+            while (file.peek() == '#') {
+                file.ignore(1 << 20, '\n');
+                file >> std::ws;
+            }
+            return bool(file >> value);
+        };
+        std::string magic;
+        int w = 0, h = 0, max_value = 0;
+        if (!(file >> magic) || magic != "P6" || !header(w) || !header(h) || !header(max_value)) return nullptr;
+        if (w <= 0 || h <= 0 || max_value <= 0 || max_value > 255) return nullptr;
+        file.get();
+        
+        std::vector<unsigned char> bytes((size_t)w * h * 3);
+        if (!file.read(reinterpret_cast<char*>(bytes.data()), bytes.size())) return nullptr;
+        AlignedVector<Color, MemoryTag::Texture> texels((size_t)w * h);
+        float scale = 1.0f / max_value;
+        for (size_t i = 0; i < texels.size(); ++i) {
+            texels[i] = Color(bytes[i * 3] * scale, bytes[i * 3 + 1] * scale, bytes[i * 3 + 2] * scale);
+        }
+        return std::make_shared<Texture>(w, h, std::move(texels));
+    }
+    
+    void buildMips() {
+        mips.clear();
+        const AlignedVector<Color, MemoryTag::Texture>* prev = &data;
+        int w = width, h = height;
+        while (w > 1 || h > 1) {
+            int nw = std::max(1, w / 2), nh = std::max(1, h / 2);
+            AlignedVector<Color, MemoryTag::Texture> level(nw * nh);
+            for (int y = 0; y < nh; ++y) {
+                for (int x = 0; x < nw; ++x) {
+                    int x0 = std::min(2 * x, w - 1), x1 = std::min(2 * x + 1, w - 1);
+                    int y0 = std::min(2 * y, h - 1), y1 = std::min(2 * y + 1, h - 1);
+                    level[y * nw + x] = ((*prev)[y0 * w + x0] + (*prev)[y0 * w + x1] +
+                                         (*prev)[y1 * w + x0] + (*prev)[y1 * w + x1]) * 0.25f;
+                }
+            }
+            mips.push_back(std::move(level));
+            prev = &mips.back();
+            w = nw;
+            h = nh;
+        }
+    }
+    
+    // Replace the texels by the first mip level, halving the resolution; false at 1x1
+    bool dropLevel() {
+        if (mips.empty()) return false;
+        data.swap(mips.front());
+        mips.erase(mips.begin());
+        width = std::max(1, width / 2);
+        height = std::max(1, height / 2);
+        return true;
+    }
+    
+    // Mean texel colour, used by the flat level-of-detail material
+    Color average() const {
+        Color sum;
+        for (const auto& texel : data) sum = sum + texel;
+        return data.empty() ? Color() : sum * (1.0f / data.size());
     }
     
     Color sample(float u, float v) const {
@@ -69,14 +304,446 @@ struct Texture {
         if (y < 0) y += height;
         return data[y * width + x];
     }
+    
+    // Nearest-mip lookup; lod is log2 of the footprint measured in level-0 texels
+    Color sample(float u, float v, float lod) const {
+        int level = std::min((int)std::max(0.0f, lod), (int)mips.size());
+        if (level == 0) return sample(u, v);
+        int w = std::max(1, width >> level), h = std::max(1, height >> level);
+        int x = (int)(u * w) % w;
+        int y = (int)(v * h) % h;
+        if (x < 0) x += w;
+        if (y < 0) y += h;
+        return mips[level - 1][y * w + x];
+    }
 };
 
 struct Ray {
     Vec3 origin, direction;
-    Ray(const Vec3& o, const Vec3& d) : origin(o), direction(d.normalize()) {}
+    Vec3 inv_dir;   // Reciprocal direction for slab tests
+    int sign[3];    // 1 where the direction component is negative
+    Ray(const Vec3& o, const Vec3& d) : origin(o), direction(d.normalize()) {
+        inv_dir = Vec3(1.0f / direction.x, 1.0f / direction.y, 1.0f / direction.z);
+        sign[0] = inv_dir.x < 0;
+        sign[1] = inv_dir.y < 0;
+        sign[2] = inv_dir.z < 0;
+    }
     Vec3 at(float t) const { return origin + direction * t; }
 };
 
+// Ray cone: footprint width at the ray origin plus a spread angle (small-angle approximation).
+// Carried alongside each ray so texture LOD, geometric LOD and caches know the pixel footprint.
+struct RayCone {
+    float width;
+    float spread_angle;
+    RayCone(float w = 0.0f, float a = 0.0f) : width(w), spread_angle(a) {}
+    
+    float widthAt(float t) const { return std::abs(width + spread_angle * t); }
+    
+    // Mirror reflection off a surface of given curvature (1 / radius); a convex
+    // surface adds twice the normal change across the footprint to the spread
+    RayCone reflect(float t, float curvature) const {
+        float w = widthAt(t);
+        return RayCone(w, spread_angle + 2.0f * w * curvature);
+    }
+    
+    // Refraction scales the spread by the index ratio and bends it by the surface curvature
+    RayCone refract(float t, float curvature, float eta) const {
+        float w = widthAt(t);
+        return RayCone(w, spread_angle * eta + std::abs(1.0f - eta) * w * curvature);
+    }
+    
+    // A diffuse bounce forgets the incoming spread and takes a wide fixed lobe
+    RayCone scatter(float t, float lobe_angle) const {
+        return RayCone(widthAt(t), lobe_angle);
+    }
+};
+
+// Orthonormal basis with the surface normal as local z
+struct Frame {
+    Vec3 s, t, n;
+    explicit Frame(const Vec3& normal) : n(normal) {
+        s = ((std::abs(n.x) > 0.1f) ? Vec3(0, 1, 0) : Vec3(1, 0, 0)).cross(n).normalize();
+        t = n.cross(s);
+    }
+    Vec3 toLocal(const Vec3& v) const { return Vec3(v.dot(s), v.dot(t), v.dot(n)); }
+    Vec3 toWorld(const Vec3& v) const { return s * v.x + t * v.y + n * v.z; }
+};
+
+// Unpolarised Fresnel reflectance of a dielectric boundary. eta is the index ratio
+// inside / outside; a negative cos_i means the light arrives from inside.
+inline float fresnelDielectric(float cos_i, float eta) {
+    if (cos_i < 0.0f) {
+        eta = 1.0f / eta;
+        cos_i = -cos_i;
+    }
+    float sin2_t = (1.0f - cos_i * cos_i) / (eta * eta);
+    if (sin2_t >= 1.0f) return 1.0f; // Total internal reflection
+    float cos_t = sqrt(1.0f - sin2_t);
+    float r_parallel = (eta * cos_i - cos_t) / (eta * cos_i + cos_t);
+    float r_perp = (cos_i - eta * cos_t) / (cos_i + eta * cos_t);
+    return (r_parallel * r_parallel + r_perp * r_perp) * 0.5f;
+}
+
+// Schlick's approximation with a coloured normal-incidence reflectance, for conductors
+inline Color fresnelSchlick(const Color& f0, float cos_i) {
+    float m = std::pow(1.0f - std::min(1.0f, std::abs(cos_i)), 5.0f);
+    return f0 + (Color(1.0f, 1.0f, 1.0f) + f0 * -1.0f) * m;
+}
+
+// Refract the outgoing direction wo (pointing away from the surface) through the
+// microfacet normal m; eta is inside / outside. etap receives the ratio actually crossed.
+inline bool refractLocal(const Vec3& wo, Vec3 m, float eta, Vec3& wi, float& etap) {
+    float cos_i = wo.dot(m);
+    if (cos_i < 0.0f) {
+        eta = 1.0f / eta;
+        cos_i = -cos_i;
+        m = m * -1.0f;
+    }
+    float sin2_t = std::max(0.0f, 1.0f - cos_i * cos_i) / (eta * eta);
+    if (sin2_t >= 1.0f) return false;
+    float cos_t = sqrt(1.0f - sin2_t);
+    wi = wo * (-1.0f / eta) + m * (cos_i / eta - cos_t);
+    etap = eta;
+    return true;
+}
+
+// Trowbridge-Reitz (GGX) microfacet distribution in the local frame
+struct GGX {
+    float alpha;
+    explicit GGX(float roughness) : alpha(std::max(roughness, 1e-4f)) {}
+    
+    // Below this the lobe is treated as a perfect (delta) specular
+    static bool isSmooth(float roughness) { return roughness < 1e-3f; }
+    
+    float D(const Vec3& m) const {
+        float cos2 = m.z * m.z;
+        if (cos2 <= 0.0f) return 0.0f;
+        float tan2 = (1.0f - cos2) / cos2;
+        float a2 = alpha * alpha;
+        float denom = M_PI * cos2 * cos2 * (a2 + tan2) * (a2 + tan2);
+        return a2 / denom;
+    }
+    
+    float lambda(const Vec3& w) const {
+        float cos2 = w.z * w.z;
+        if (cos2 <= 0.0f) return 0.0f;
+        float tan2 = (1.0f - cos2) / cos2;
+        return (sqrt(1.0f + alpha * alpha * tan2) - 1.0f) * 0.5f;
+    }
+    
+    // Height-correlated Smith masking-shadowing
+    float G(const Vec3& wo, const Vec3& wi) const {
+        return 1.0f / (1.0f + lambda(wo) + lambda(wi));
+    }
+    
+    // Microfacet normal sampled proportionally to D(m) cos(theta_m)
+    Vec3 sample(float u1, float u2) const {
+        float tan2 = alpha * alpha * u1 / std::max(1e-7f, 1.0f - u1);
+        float cos_theta = 1.0f / sqrt(1.0f + tan2);
+        float sin_theta = sqrt(std::max(0.0f, 1.0f - cos_theta * cos_theta));
+        float phi = 2.0f * M_PI * u2;
+        return Vec3(sin_theta * cos(phi), sin_theta * sin(phi), cos_theta);
+    }
+    
+    float pdf(const Vec3& m) const {
+        return D(m) * std::abs(m.z);
+    }
+};
+
+// Physically based surface description. Lambert and Coated take their albedo from the
+// surface colour (and texture); Conductor uses tint as its normal-incidence reflectance and
+// Dielectric as its transmission colour.
+enum class MaterialType { Lambert, Conductor, Dielectric, Coated };
+
+inline const char* materialTypeName(MaterialType type) {
+    switch (type) {
+        case MaterialType::Lambert: return "diffuse";
+        case MaterialType::Conductor: return "metal";
+        case MaterialType::Dielectric: return "glass";
+        case MaterialType::Coated: return "coated";
+    }
+    return "";
+}
+
+struct Material {
+    MaterialType type;
+    Color tint;
+    float roughness;   // GGX alpha; 0 is perfectly smooth
+    float ior;         // Dielectric or coat index of refraction
+    
+    static Material lambert() { return {MaterialType::Lambert, Color(1.0f, 1.0f, 1.0f), 1.0f, 1.0f}; }
+    static Material conductor(const Color& f0, float roughness) { return {MaterialType::Conductor, f0, roughness, 1.0f}; }
+    static Material dielectric(float ior, float roughness, const Color& tint = Color(1.0f, 1.0f, 1.0f)) {
+        return {MaterialType::Dielectric, tint, roughness, ior};
+    }
+    static Material coated(float ior, float roughness) { return {MaterialType::Coated, Color(1.0f, 1.0f, 1.0f), roughness, ior}; }
+    
+    // Closest physically based reading of the legacy metallic / transparency parameters
+    static Material fromLegacy(const Color& color, float metallic, float transparency, float refractive_index) {
+        if (transparency > 0.0f) return dielectric(refractive_index, 0.0f);
+        if (metallic > 0.0f) return conductor(color, (1.0f - metallic) * 0.5f);
+        return lambert();
+    }
+};
+
+// Result of importance sampling a BSDF: weight is f * |cos| / pdf. Specular (delta) samples
+// report pdf 0 since their density cannot be evaluated for other strategies.
+struct BsdfSample {
+    Vec3 wi;
+    Color weight;
+    float pdf = 0.0f;
+    bool specular = false;
+};
+
+// BSDF instance at one surface point. All directions point away from the surface and are
+// given in world space. radiance selects camera-path transport (true) or light-path
+// transport, which differ in the refraction scaling of rough and smooth transmission.
+class Bsdf {
+public:
+    Bsdf() : material(Material::lambert()), frame(Vec3(0, 0, 1)) {}
+    Bsdf(const Material& m, const Color& albedo, const Vec3& normal)
+        : material(m), albedo(albedo), frame(normal) {}
+    
+    // True when every lobe is a delta distribution, so the vertex cannot be connected to
+    bool isDelta() const {
+        return (material.type == MaterialType::Conductor || material.type == MaterialType::Dielectric) &&
+               GGX::isSmooth(material.roughness);
+    }
+    
+    // Non-delta part of the BSDF
+    Color f(const Vec3& wo_world, const Vec3& wi_world, bool radiance) const {
+        Vec3 wo = frame.toLocal(wo_world), wi = frame.toLocal(wi_world);
+        if (wo.z == 0.0f || wi.z == 0.0f) return Color();
+        switch (material.type) {
+            case MaterialType::Lambert:
+                return wo.z * wi.z > 0.0f ? albedo * (1.0f / M_PI) : Color();
+            case MaterialType::Conductor:
+                return isDelta() ? Color() : conductorF(wo, wi);
+            case MaterialType::Dielectric:
+                return isDelta() ? Color() : dielectricF(wo, wi, radiance);
+            case MaterialType::Coated:
+                return coatedF(wo, wi);
+        }
+        return Color();
+    }
+    
+    // Solid-angle density of sample() producing wi from wo, over the non-delta lobes
+    float pdf(const Vec3& wo_world, const Vec3& wi_world) const {
+        Vec3 wo = frame.toLocal(wo_world), wi = frame.toLocal(wi_world);
+        if (wo.z == 0.0f || wi.z == 0.0f) return 0.0f;
+        switch (material.type) {
+            case MaterialType::Lambert:
+                return wo.z * wi.z > 0.0f ? std::abs(wi.z) / M_PI : 0.0f;
+            case MaterialType::Conductor:
+                return isDelta() ? 0.0f : reflectionPdf(wo, wi);
+            case MaterialType::Dielectric:
+                return isDelta() ? 0.0f : dielectricPdf(wo, wi);
+            case MaterialType::Coated: {
+                if (wo.z * wi.z <= 0.0f) return 0.0f;
+                float p_coat = coatProbability(wo);
+                float diffuse = (1.0f - p_coat) * std::abs(wi.z) / M_PI;
+                return GGX::isSmooth(material.roughness) ? diffuse : diffuse + p_coat * reflectionPdf(wo, wi);
+            }
+        }
+        return 0.0f;
+    }
+    
+    // Pick one lobe with u_lobe and a direction from it with (u1, u2)
+    bool sample(const Vec3& wo_world, float u_lobe, float u1, float u2, bool radiance, BsdfSample& out) const {
+        Vec3 wo = frame.toLocal(wo_world);
+        if (wo.z == 0.0f) return false;
+        Vec3 wi;
+        switch (material.type) {
+            case MaterialType::Lambert:
+                wi = cosineLocal(wo, u1, u2);
+                out.specular = false;
+                break;
+            case MaterialType::Conductor:
+                if (isDelta()) {
+                    wi = Vec3(-wo.x, -wo.y, wo.z);
+                    out.wi = frame.toWorld(wi);
+                    out.weight = fresnelSchlick(material.tint, wo.z);
+                    out.pdf = 0.0f;
+                    out.specular = true;
+                    return true;
+                }
+                wi = reflectLocal(wo, GGX(material.roughness).sample(u1, u2));
+                out.specular = false;
+                break;
+            case MaterialType::Dielectric:
+                return sampleDielectric(wo, u_lobe, u1, u2, radiance, out);
+            case MaterialType::Coated: {
+                float p_coat = coatProbability(wo);
+                if (u_lobe < p_coat) {
+                    if (GGX::isSmooth(material.roughness)) {
+                        wi = Vec3(-wo.x, -wo.y, wo.z);
+                        float F = fresnelDielectric(std::abs(wo.z), material.ior);
+                        out.wi = frame.toWorld(wi);
+                        out.weight = Color(1.0f, 1.0f, 1.0f) * (F / p_coat);
+                        out.pdf = 0.0f;
+                        out.specular = true;
+                        return true;
+                    }
+                    wi = reflectLocal(wo, GGX(material.roughness).sample(u1, u2));
+                } else {
+                    wi = cosineLocal(wo, u1, u2);
+                }
+                out.specular = false;
+                break;
+            }
+        }
+        
+        out.wi = frame.toWorld(wi);
+        out.pdf = pdf(wo_world, out.wi);
+        if (out.pdf <= 0.0f) return false;
+        out.weight = f(wo_world, out.wi, radiance) * (std::abs(wi.z) / out.pdf);
+        return true;
+    }
+    
+private:
+    static Vec3 reflectLocal(const Vec3& wo, const Vec3& m) {
+        return m * (2.0f * wo.dot(m)) - wo;
+    }
+    
+    // Cosine-weighted direction on the same side as wo
+    static Vec3 cosineLocal(const Vec3& wo, float u1, float u2) {
+        float r = sqrt(u1), phi = 2.0f * M_PI * u2;
+        float z = sqrt(std::max(0.0f, 1.0f - u1));
+        return Vec3(r * cos(phi), r * sin(phi), wo.z > 0.0f ? z : -z);
+    }
+    
+    // Microfacet normal of a reflection pair, flipped into the upper hemisphere
+    static Vec3 halfVector(const Vec3& wo, const Vec3& wi) {
+        Vec3 m = (wo + wi).normalize();
+        return m.z < 0.0f ? m * -1.0f : m;
+    }
+    
+    float reflectionPdf(const Vec3& wo, const Vec3& wi) const {
+        if (wo.z * wi.z <= 0.0f) return 0.0f;
+        Vec3 m = halfVector(wo, wi);
+        return GGX(material.roughness).pdf(m) / (4.0f * std::abs(wo.dot(m)));
+    }
+    
+    Color conductorF(const Vec3& wo, const Vec3& wi) const {
+        if (wo.z * wi.z <= 0.0f) return Color();
+        GGX ggx(material.roughness);
+        Vec3 m = halfVector(wo, wi);
+        float specular = ggx.D(m) * ggx.G(wo, wi) / (4.0f * std::abs(wo.z * wi.z));
+        return fresnelSchlick(material.tint, wo.dot(m)) * specular;
+    }
+    
+    // Generalised half vector of a dielectric pair; false for back-facing microfacets
+    bool dielectricHalfVector(const Vec3& wo, const Vec3& wi, Vec3& m, float& etap) const {
+        bool reflect = wo.z * wi.z > 0.0f;
+        etap = reflect ? 1.0f : (wo.z > 0.0f ? material.ior : 1.0f / material.ior);
+        m = wi * etap + wo;
+        if (m.dot(m) == 0.0f) return false;
+        m = m.normalize();
+        if (m.z < 0.0f) m = m * -1.0f;
+        return m.dot(wi) * wi.z >= 0.0f && m.dot(wo) * wo.z >= 0.0f;
+    }
+    
+    Color dielectricF(const Vec3& wo, const Vec3& wi, bool radiance) const {
+        Vec3 m;
+        float etap;
+        if (!dielectricHalfVector(wo, wi, m, etap)) return Color();
+        GGX ggx(material.roughness);
+        float F = fresnelDielectric(wo.dot(m), material.ior);
+        if (wo.z * wi.z > 0.0f) {
+            float value = ggx.D(m) * ggx.G(wo, wi) * F / std::abs(4.0f * wo.z * wi.z);
+            return Color(value, value, value);
+        }
+        float denom = wi.dot(m) + wo.dot(m) / etap;
+        denom = denom * denom * wi.z * wo.z;
+        float value = ggx.D(m) * (1.0f - F) * ggx.G(wo, wi) * std::abs(wi.dot(m) * wo.dot(m) / denom);
+        if (radiance) value /= etap * etap;
+        return material.tint * value;
+    }
+    
+    float dielectricPdf(const Vec3& wo, const Vec3& wi) const {
+        Vec3 m;
+        float etap;
+        if (!dielectricHalfVector(wo, wi, m, etap)) return 0.0f;
+        GGX ggx(material.roughness);
+        float F = fresnelDielectric(wo.dot(m), material.ior);
+        if (wo.z * wi.z > 0.0f) return F * ggx.pdf(m) / (4.0f * std::abs(wo.dot(m)));
+        float denom = wi.dot(m) + wo.dot(m) / etap;
+        float jacobian = std::abs(wi.dot(m)) / (denom * denom);
+        return (1.0f - F) * ggx.pdf(m) * jacobian;
+    }
+    
+    bool sampleDielectric(const Vec3& wo, float u_lobe, float u1, float u2, bool radiance, BsdfSample& out) const {
+        if (isDelta()) {
+            // Smooth interface: choose reflection with probability equal to the Fresnel term
+            float F = fresnelDielectric(wo.z, material.ior);
+            Vec3 wi;
+            if (u_lobe < F) {
+                wi = Vec3(-wo.x, -wo.y, wo.z);
+                out.weight = Color(1.0f, 1.0f, 1.0f);
+            } else {
+                float etap;
+                if (!refractLocal(wo, Vec3(0, 0, 1), material.ior, wi, etap)) return false;
+                // Radiance is compressed into the smaller solid angle on the dense side
+                out.weight = material.tint * (radiance ? 1.0f / (etap * etap) : 1.0f);
+            }
+            out.wi = frame.toWorld(wi);
+            out.pdf = 0.0f;
+            out.specular = true;
+            return true;
+        }
+        
+        Vec3 m = GGX(material.roughness).sample(u1, u2);
+        float F = fresnelDielectric(wo.dot(m), material.ior);
+        Vec3 wi;
+        if (u_lobe < F) {
+            wi = reflectLocal(wo, m);
+            if (wo.z * wi.z <= 0.0f) return false;
+        } else {
+            float etap;
+            if (!refractLocal(wo, m, material.ior, wi, etap) || wo.z * wi.z > 0.0f || wi.z == 0.0f) return false;
+        }
+        Vec3 wo_world = frame.toWorld(wo);
+        out.wi = frame.toWorld(wi);
+        out.pdf = pdf(wo_world, out.wi);
+        out.specular = false;
+        if (out.pdf <= 0.0f) return false;
+        out.weight = f(wo_world, out.wi, radiance) * (std::abs(wi.z) / out.pdf);
+        return true;
+    }
+    
+    // Coat lobe probability, the coat's Fresnel reflectance kept away from 0 and 1 so both
+    // lobes stay reachable
+    float coatProbability(const Vec3& wo) const {
+        float F = fresnelDielectric(std::abs(wo.z), material.ior);
+        return std::min(0.9f, std::max(0.1f, F));
+    }
+    
+    // Dielectric coat over a Lambertian base: GGX reflection off the coat plus the base seen
+    // through two Fresnel transmissions (an energy-conserving approximation of the layer)
+    Color coatedF(const Vec3& wo, const Vec3& wi) const {
+        if (wo.z * wi.z <= 0.0f) return Color();
+        float t_in = 1.0f - fresnelDielectric(std::abs(wi.z), material.ior);
+        float t_out = 1.0f - fresnelDielectric(std::abs(wo.z), material.ior);
+        Color result = albedo * (t_in * t_out / M_PI);
+        if (!GGX::isSmooth(material.roughness)) {
+            GGX ggx(material.roughness);
+            Vec3 m = halfVector(wo, wi);
+            float F = fresnelDielectric(std::abs(wo.dot(m)), material.ior);
+            float specular = ggx.D(m) * ggx.G(wo, wi) * F / (4.0f * std::abs(wo.z * wi.z));
+            result = result + Color(specular, specular, specular);
+        }
+        return result;
+    }
+    
+    Material material;
+    Color albedo;
+    Frame frame;
+};
+
+// Shading level of detail, from full recursive shading down to a flat diffuse impostor
+enum class ShadingLod { Full, NoIndirect, DiffuseOnly };
+
 struct Sphere {
     Vec3 center;
     float radius;
@@ -85,289 +752,5151 @@ struct Sphere {
     float transparency;
     float refractive_index;
     Texture* texture;
+    Color lod_color; // Diffuse-only stand-in used when the sphere is too small to resolve
+    Material material; // Used by the physically based engines; trace() keeps the legacy floats
     
     Sphere(const Vec3& c, float r, const Color& col, float met = 0.0f, float trans = 0.0f, 
            float ri = 1.0f, Texture* tex = nullptr)
         : center(c), radius(r), color(col), metallic(met), transparency(trans), 
-          refractive_index(ri), texture(tex) {}
+          refractive_index(ri), texture(tex), lod_color(tex ? tex->average() * col : col),
+          material(Material::fromLegacy(col, met, trans, ri)) {}
+    
+    // Adopt a physically based material, deriving the legacy parameters trace() reads
+    void setMaterial(const Material& m) {
+        material = m;
+        metallic = m.type == MaterialType::Conductor ? std::max(0.05f, 1.0f - 2.0f * m.roughness) : 0.0f;
+        transparency = m.type == MaterialType::Dielectric ? 0.9f : 0.0f;
+        refractive_index = m.type == MaterialType::Dielectric ? m.ior : 1.0f;
+    }
+    
+    // Same colour, material and texture, whatever the position and size
+    bool sameLook(const Sphere& other) const {
+        return color.r == other.color.r && color.g == other.color.g && color.b == other.color.b &&
+               texture == other.texture && metallic == other.metallic && transparency == other.transparency &&
+               refractive_index == other.refractive_index && material.type == other.material.type &&
+               material.tint.r == other.material.tint.r && material.tint.g == other.material.tint.g &&
+               material.tint.b == other.material.tint.b && material.roughness == other.material.roughness &&
+               material.ior == other.material.ior;
+    }
+    
+    void setColor(const Color& c) {
+        color = c;
+        lod_color = texture ? texture->average() * c : c;
+        if (material.type == MaterialType::Conductor) material.tint = c;
+    }
     
     float intersect(const Ray& ray) const {
-        Vec3 oc = ray.origin - center;
-        float a = ray.direction.dot(ray.direction);
-        float b = 2.0f * oc.dot(ray.direction);
+        return intersect(ray.origin, ray.direction);
+    }
+    
+    float intersect(const Vec3& origin, const Vec3& direction) const {
+        Vec3 oc = origin - center;
+        float a = direction.dot(direction);
+        float b = 2.0f * oc.dot(direction);
         float c = oc.dot(oc) - radius * radius;
         float discriminant = b * b - 4 * a * c;
         
-        if (discriminant < 0) return -1;
+        if (discriminant < 0) return -1;
+        
+        float sqrt_discriminant = sqrt(discriminant);
+        float t = (-b - sqrt_discriminant) / (2.0f * a);
+        if (t > 0.001f) return t;
+        
+        // Origin inside the sphere: the exit point is the far root
+        t = (-b + sqrt_discriminant) / (2.0f * a);
+        return t > 0.001f ? t : -1;
+    }
+    
+    Vec3 normal(const Vec3& point) const {
+        return (point - center).normalize();
+    }
+    
+    // Get UV coordinates for texture mapping
+    void getUV(const Vec3& point, float& u, float& v) const {
+        Vec3 n = normal(point);
+        u = 0.5f + atan2(n.z, n.x) / (2 * M_PI);
+        v = 0.5f - asin(n.y) / M_PI;
+    }
+    
+    Color getColor(const Vec3& point) const {
+        if (texture) {
+            float u, v;
+            getUV(point, u, v);
+            return texture->sample(u, v) * color;
+        }
+        return color;
+    }
+    
+    // Filtered colour for a ray footprint of the given world-space width
+    Color getColor(const Vec3& point, float footprint) const {
+        if (texture) {
+            float u, v;
+            getUV(point, u, v);
+            // The texture wraps the equator once, so one texel spans 2*pi*r / width
+            float texel_size = 2.0f * M_PI * radius / texture->width;
+            float lod = footprint > texel_size ? log2(footprint / texel_size) : 0.0f;
+            return texture->sample(u, v, lod) * color;
+        }
+        return color;
+    }
+    
+    Bsdf bsdfAt(const Vec3& point) const {
+        return Bsdf(material, getColor(point), normal(point));
+    }
+};
+
+// Integer hash from the PCG family (Jarzynski & Olano 2020): a few multiplies and shifts,
+// no state, so it vectorises across SIMD lanes
+inline uint32_t pcgHash(uint32_t v) {
+    uint32_t state = v * 747796405u + 2891336453u;
+    uint32_t word = ((state >> ((state >> 28u) + 4u)) ^ state) * 277803737u;
+    return (word >> 22u) ^ word;
+}
+
+// Counter-based uniform [0, 1) number: a pure function of where it is used, so images do
+// not depend on thread count, tile order or scheduling
+inline float counterRandom(uint32_t pixel, uint32_t sample, uint32_t bounce, uint32_t dimension,
+                           uint32_t frame, uint32_t seed) {
+    uint32_t h = pcgHash(dimension);
+    h = pcgHash(h ^ bounce);
+    h = pcgHash(h ^ sample);
+    h = pcgHash(h ^ pixel);
+    h = pcgHash(h ^ frame);
+    h = pcgHash(h ^ seed);
+    return (h >> 8) * (1.0f / 16777216.0f);
+}
+
+// Key of one sample's random numbers; successive draws advance the dimension
+struct RandomStream {
+    uint32_t pixel = 0, sample = 0, frame = 0, seed = 0;
+    uint32_t bounce = 0, dimension = 0;
+    
+    RandomStream() {}
+    RandomStream(uint32_t pixel, uint32_t sample, uint32_t frame, uint32_t seed)
+        : pixel(pixel), sample(sample), frame(frame), seed(seed) {}
+    
+    float next() { return counterRandom(pixel, sample, bounce, dimension++, frame, seed); }
+};
+
+// Stream of the sample the calling thread is working on; render workers key it per pixel sample
+inline RandomStream& currentRandomStream() {
+    thread_local RandomStream stream;
+    return stream;
+}
+
+inline float random01() {
+    return currentRandomStream().next();
+}
+
+// Cosine-weighted direction around the normal from two uniform numbers
+inline Vec3 cosineHemisphere(const Vec3& normal, float r1, float r2) {
+    float cos_theta = sqrt(r1);
+    float sin_theta = sqrt(1.0f - r1);
+    float phi = 2 * M_PI * r2;
+    
+    Vec3 w = normal;
+    Vec3 u = ((std::abs(w.x) > 0.1f) ? Vec3(0, 1, 0) : Vec3(1, 0, 0)).cross(w).normalize();
+    Vec3 v = w.cross(u);
+    
+    return u * cos(phi) * sin_theta + v * sin(phi) * sin_theta + w * cos_theta;
+}
+
+// Lock-free accumulation in 40.24 fixed point. Integer addition is associative, so sums
+// come out bit-identical whichever thread adds first (float atomics would round differently).
+constexpr double kFixedPointScale = 16777216.0;
+
+inline void atomicAdd(std::atomic<int64_t>& target, float value) {
+    if (!std::isfinite(value)) return;
+    double scaled = std::max(-1e11, std::min(1e11, (double)value)) * kFixedPointScale;
+    target.fetch_add((int64_t)std::llround(scaled), std::memory_order_relaxed);
+}
+
+inline float fromFixedPoint(const std::atomic<int64_t>& value) {
+    return (float)(value.load(std::memory_order_relaxed) / kFixedPointScale);
+}
+
+// Run fn(i) for i in [0, count), split into contiguous bands across the given number of threads
+template <typename Fn>
+void parallelFor(int count, int threads, Fn&& fn) {
+    if (count <= 0) return;
+    int band = (count + threads - 1) / threads;
+    if (band >= count) {
+        for (int i = 0; i < count; ++i) fn(i);
+        return;
+    }
+    std::vector<std::thread> workers;
+    for (int begin = 0; begin < count; begin += band) {
+        int end = std::min(count, begin + band);
+        workers.emplace_back([&fn, begin, end] {
+            for (int i = begin; i < end; ++i) fn(i);
+        });
+    }
+    for (auto& worker : workers) worker.join();
+}
+
+// Axis-aligned bounding box
+struct AABB {
+    Vec3 lo, hi;
+    AABB() : lo(1e30f, 1e30f, 1e30f), hi(-1e30f, -1e30f, -1e30f) {}
+    AABB(const Vec3& lo, const Vec3& hi) : lo(lo), hi(hi) {}
+    
+    void expand(const Vec3& p) {
+        lo = Vec3(std::min(lo.x, p.x), std::min(lo.y, p.y), std::min(lo.z, p.z));
+        hi = Vec3(std::max(hi.x, p.x), std::max(hi.y, p.y), std::max(hi.z, p.z));
+    }
+    void expand(const AABB& b) {
+        lo = Vec3(std::min(lo.x, b.lo.x), std::min(lo.y, b.lo.y), std::min(lo.z, b.lo.z));
+        hi = Vec3(std::max(hi.x, b.hi.x), std::max(hi.y, b.hi.y), std::max(hi.z, b.hi.z));
+    }
+    Vec3 centroid() const { return (lo + hi) * 0.5f; }
+    bool empty() const { return lo.x > hi.x; }
+    float surfaceArea() const {
+        if (empty()) return 0.0f;
+        Vec3 d = hi - lo;
+        return 2.0f * (d.x * d.y + d.y * d.z + d.z * d.x);
+    }
+    
+    const Vec3& bound(int i) const { return i ? hi : lo; }
+    
+    // Slab test using the ray's precomputed reciprocal direction and sign bits
+    bool intersect(const Ray& ray, float t_max) const {
+        float tx0 = (bound(ray.sign[0]).x - ray.origin.x) * ray.inv_dir.x;
+        float tx1 = (bound(1 - ray.sign[0]).x - ray.origin.x) * ray.inv_dir.x;
+        float ty0 = (bound(ray.sign[1]).y - ray.origin.y) * ray.inv_dir.y;
+        float ty1 = (bound(1 - ray.sign[1]).y - ray.origin.y) * ray.inv_dir.y;
+        float tz0 = (bound(ray.sign[2]).z - ray.origin.z) * ray.inv_dir.z;
+        float tz1 = (bound(1 - ray.sign[2]).z - ray.origin.z) * ray.inv_dir.z;
+        float t_near = std::max(std::max(tx0, ty0), std::max(tz0, 0.0f));
+        float t_far = std::min(std::min(tx1, ty1), std::min(tz1, t_max));
+        return t_near <= t_far;
+    }
+    
+    // Euclidean distance from p to the box, 0 inside
+    float distance(const Vec3& p) const {
+        float dx = std::max(std::max(lo.x - p.x, p.x - hi.x), 0.0f);
+        float dy = std::max(std::max(lo.y - p.y, p.y - hi.y), 0.0f);
+        float dz = std::max(std::max(lo.z - p.z, p.z - hi.z), 0.0f);
+        return sqrt(dx * dx + dy * dy + dz * dz);
+    }
+};
+
+// Up to kSize rays in SoA layout, traversed together by BVH::traversePacket. The slab test
+// is a plain loop over the lanes that g++ -O3 vectorises (check with -fopt-info-vec): lanes
+// write an int mask and the any-hit reduction runs as a second loop.
+struct RayPacket {
+    static constexpr int kSize = 8;
+    float ox[kSize], oy[kSize], oz[kSize];
+    float dx[kSize], dy[kSize], dz[kSize];   // Normalised, as Ray stores them
+    float ix[kSize], iy[kSize], iz[kSize];   // Reciprocal directions
+    float t_max[kSize];                      // Negative for unused or finished lanes
+    int sign[3] = {0, 0, 0};                 // Direction signs of lane 0, for near-child order
+    int count = 0;
+    
+    RayPacket() {
+        std::fill(t_max, t_max + kSize, -1.0f);
+        std::fill(ox, ox + kSize, 0.0f);
+        std::fill(oy, oy + kSize, 0.0f);
+        std::fill(oz, oz + kSize, 0.0f);
+        std::fill(ix, ix + kSize, 1.0f);
+        std::fill(iy, iy + kSize, 1.0f);
+        std::fill(iz, iz + kSize, 1.0f);
+    }
+    
+    void add(const Vec3& origin, const Vec3& direction, float limit) {
+        Ray ray(origin, direction);
+        int lane = count++;
+        ox[lane] = ray.origin.x;
+        oy[lane] = ray.origin.y;
+        oz[lane] = ray.origin.z;
+        dx[lane] = ray.direction.x;
+        dy[lane] = ray.direction.y;
+        dz[lane] = ray.direction.z;
+        ix[lane] = ray.inv_dir.x;
+        iy[lane] = ray.inv_dir.y;
+        iz[lane] = ray.inv_dir.z;
+        t_max[lane] = limit;
+        if (lane == 0) std::copy(ray.sign, ray.sign + 3, sign);
+    }
+    
+    Vec3 origin(int lane) const { return Vec3(ox[lane], oy[lane], oz[lane]); }
+    Vec3 direction(int lane) const { return Vec3(dx[lane], dy[lane], dz[lane]); }
+    
+    // Slab test of every lane against a box; active[i] becomes -1 for lanes that hit and 0
+    // otherwise. Returns whether any lane hit.
+    bool intersect(const AABB& box, int active[kSize]) const {
+        Vec3 lo = box.lo, hi = box.hi;
+        for (int i = 0; i < kSize; ++i) {
+            float tx0 = (lo.x - ox[i]) * ix[i], tx1 = (hi.x - ox[i]) * ix[i];
+            float ty0 = (lo.y - oy[i]) * iy[i], ty1 = (hi.y - oy[i]) * iy[i];
+            float tz0 = (lo.z - oz[i]) * iz[i], tz1 = (hi.z - oz[i]) * iz[i];
+            float t_near = std::max(std::max(std::min(tx0, tx1), std::min(ty0, ty1)), std::max(std::min(tz0, tz1), 0.0f));
+            float t_far = std::min(std::min(std::max(tx0, tx1), std::max(ty0, ty1)), std::min(std::max(tz0, tz1), t_max[i]));
+            active[i] = t_near <= t_far ? -1 : 0;
+        }
+        int any = 0;
+        for (int i = 0; i < kSize; ++i) any |= active[i];
+        return any != 0;
+    }
+};
+
+inline AABB sphereBounds(const Sphere& sphere) {
+    Vec3 r(sphere.radius, sphere.radius, sphere.radius);
+    return AABB(sphere.center - r, sphere.center + r);
+}
+
+struct BVHNode {
+    AABB bounds;
+    int left = -1, right = -1;   // Children of an interior node
+    int parent = -1;
+    int first = 0, count = 0;    // Range in BVH::prim_indices of a leaf (count > 0)
+    int axis = 0;                // Split axis; the left child has the lower centroid along it
+    bool isLeaf() const { return count > 0; }
+};
+
+// Build presets, trading build time for traversal cost:
+//   Fast:        LBVH from a parallel radix sort of Morton codes (per-frame rebuilds, edits)
+//   Balanced:    binned SAH with task-parallel recursion
+//   HighQuality: binned SAH followed by treelet restructuring (final frames)
+enum class BvhPreset { Fast, Balanced, HighQuality };
+
+// Traversal kernels: a full per-ray stack, a 4-entry short stack that restarts through
+// parent pointers on overflow, and fully stackless parent-pointer traversal
+enum class BvhTraversal { Stack, ShortStack, Stackless };
+
+inline const char* bvhTraversalName(BvhTraversal traversal) {
+    switch (traversal) {
+        case BvhTraversal::Stack: return "stack";
+        case BvhTraversal::ShortStack: return "short stack";
+        case BvhTraversal::Stackless: return "stackless";
+    }
+    return "";
+}
+
+inline const char* bvhPresetName(BvhPreset preset) {
+    switch (preset) {
+        case BvhPreset::Fast: return "LBVH";
+        case BvhPreset::Balanced: return "binned SAH";
+        case BvhPreset::HighQuality: return "SAH + treelets";
+    }
+    return "";
+}
+
+// Bounding volume hierarchy over the scene's spheres
+class BVH {
+public:
+    struct BuildStats {
+        double build_ms = 0.0;
+        float sah_cost = 0.0f;   // Expected traversal + intersection cost per ray, relative to the root
+        int nodes = 0, leaves = 0;
+    };
+    
+    AlignedVector<BVHNode, MemoryTag::Accel> nodes;
+    AlignedVector<int, MemoryTag::Accel> prim_indices;
+    int root = -1;
+    BvhTraversal traversal = BvhTraversal::Stack;
+    
+    BuildStats build(const std::vector<Sphere>& spheres, BvhPreset preset, int threads) {
+        auto start = std::chrono::high_resolution_clock::now();
+        int n = (int)spheres.size();
+        nodes.clear();
+        prim_leaf.clear();
+        dead_nodes = 0;
+        prim_indices.resize(n);
+        for (int i = 0; i < n; ++i) prim_indices[i] = i;
+        root = -1;
+        
+        if (n > 0) {
+            prim_bounds.resize(n);
+            for (int i = 0; i < n; ++i) prim_bounds[i] = sphereBounds(spheres[i]);
+            if (preset == BvhPreset::Fast) {
+                buildLBVH(threads);
+            } else {
+                buildBinnedSAH(threads);
+                if (preset == BvhPreset::HighQuality) optimizeTreelets(threads);
+            }
+            orderChildren();
+            prim_leaf.assign(n, -1);
+            for (int i = 0; i < (int)nodes.size(); ++i) {
+                if (!nodes[i].isLeaf()) continue;
+                for (int j = nodes[i].first; j < nodes[i].first + nodes[i].count; ++j) prim_leaf[prim_indices[j]] = i;
+            }
+        }
+        
+        BuildStats stats;
+        stats.build_ms = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+        stats.sah_cost = sahCost();
+        stats.nodes = (int)nodes.size();
+        for (const auto& node : nodes) stats.leaves += node.isLeaf() ? 1 : 0;
+        return stats;
+    }
+    
+    // Refit the bounds above the moved primitives, keeping the topology. Cheap, but the
+    // tree degrades as primitives drift from where they were built; compare sahCost()
+    // against the build to decide when to rebuild.
+    void refit(const std::vector<Sphere>& spheres, const std::vector<int>& moved) {
+        for (int prim : moved) {
+            refitLeaf(spheres, prim_leaf[prim]);
+            refitAncestors(prim_leaf[prim]);
+        }
+    }
+    
+    // Insert primitive prim (already in spheres) as a new leaf beside the leaf its bounds
+    // grow least, then refit above it. Returns false, leaving the tree unchanged, when the
+    // insertion would get too deep for the traversal stack; the caller rebuilds instead.
+    bool insert(const std::vector<Sphere>& spheres, int prim) {
+        AABB box = sphereBounds(spheres[prim]);
+        int target = root, depth = 1;
+        while (target >= 0 && !nodes[target].isLeaf()) {
+            const BVHNode& node = nodes[target];
+            target = growth(nodes[node.left].bounds, box) <= growth(nodes[node.right].bounds, box) ? node.left : node.right;
+            if (++depth >= kStackSize / 2) return false;
+        }
+        
+        BVHNode leaf;
+        leaf.bounds = box;
+        leaf.first = (int)prim_indices.size();
+        leaf.count = 1;
+        int leaf_index = (int)nodes.size();
+        nodes.push_back(leaf);
+        prim_indices.push_back(prim);
+        if ((int)prim_leaf.size() <= prim) prim_leaf.resize(prim + 1, -1);
+        prim_leaf[prim] = leaf_index;
+        if (target < 0) {
+            root = leaf_index;
+            return true;
+        }
+        
+        // A new interior node takes the target's place with the target and the leaf below it
+        BVHNode interior;
+        interior.left = target;
+        interior.right = leaf_index;
+        interior.parent = nodes[target].parent;
+        int interior_index = (int)nodes.size();
+        nodes.push_back(interior);
+        replaceChild(interior.parent, target, interior_index);
+        nodes[target].parent = interior_index;
+        nodes[leaf_index].parent = interior_index;
+        refitAncestors(leaf_index);
+        orderChildren(nodes[interior_index]);
+        return true;
+    }
+    
+    // Remove primitive prim and relabel primitive last as prim, mirroring a swap-remove
+    // from the sphere array (spheres is the array after it). A leaf left empty is spliced
+    // out with its parent; its sibling moves up.
+    void remove(const std::vector<Sphere>& spheres, int prim, int last) {
+        int node = prim_leaf[prim];
+        BVHNode& leaf = nodes[node];
+        int end = leaf.first + leaf.count - 1;
+        for (int i = leaf.first; i <= end; ++i) {
+            if (prim_indices[i] == prim) std::swap(prim_indices[i], prim_indices[end]);
+        }
+        --leaf.count;
+        
+        if (leaf.count == 0) {
+            int parent = leaf.parent;
+            dead_nodes += parent >= 0 ? 2 : 1;
+            if (parent < 0) {
+                root = -1;
+                node = -1;
+            } else {
+                int survivor = sibling(node);
+                int grandparent = nodes[parent].parent;
+                nodes[survivor].parent = grandparent;
+                replaceChild(grandparent, parent, survivor);
+                nodes[parent] = BVHNode();
+                node = survivor;
+            }
+            nodes[prim_leaf[prim]] = BVHNode();
+        }
+        
+        if (last != prim) {
+            const BVHNode& holder = nodes[prim_leaf[last]];
+            for (int i = holder.first; i < holder.first + holder.count; ++i) {
+                if (prim_indices[i] == last) prim_indices[i] = prim;
+            }
+            prim_leaf[prim] = prim_leaf[last];
+        }
+        prim_leaf.pop_back();
+        
+        if (node < 0) return;
+        if (nodes[node].isLeaf()) refitLeaf(spheres, node);
+        refitAncestors(node);
+    }
+    
+    // More than half of the node array unlinked by removals; a rebuild compacts it
+    bool fragmented() const {
+        return dead_nodes * 2 > (int)nodes.size();
+    }
+    
+    // Walks from the root, so nodes unlinked by remove() do not count
+    float sahCost() const {
+        if (root < 0) return 0.0f;
+        float total = 0.0f;
+        std::vector<int> stack(1, root);
+        while (!stack.empty()) {
+            const BVHNode& node = nodes[stack.back()];
+            stack.pop_back();
+            if (node.isLeaf()) {
+                total += kIntersectCost * node.count * node.bounds.surfaceArea();
+            } else {
+                total += kTraversalCost * node.bounds.surfaceArea();
+                stack.push_back(node.left);
+                stack.push_back(node.right);
+            }
+        }
+        return total / std::max(1e-12f, nodes[root].bounds.surfaceArea());
+    }
+    
+    // Closest hit; returns the primitive index or -1
+    int intersect(const std::vector<Sphere>& spheres, const Ray& ray, float& closest_t) const {
+        closest_t = 1e30f;
+        int hit = -1;
+        traverse(ray, closest_t, [&](const BVHNode& leaf, float& t_max) {
+            for (int i = leaf.first; i < leaf.first + leaf.count; ++i) {
+                float t = spheres[prim_indices[i]].intersect(ray);
+                if (t > 0 && t < t_max) {
+                    t_max = t;
+                    hit = prim_indices[i];
+                }
+            }
+            return false;
+        });
+        return hit;
+    }
+    
+    // Any hit with 0 < t < t_max, ignoring primitive skip (-1 for none)
+    bool occluded(const std::vector<Sphere>& spheres, const Ray& ray, float t_max, int skip = -1) const {
+        bool blocked = false;
+        traverse(ray, t_max, [&](const BVHNode& leaf, float& t_limit) {
+            for (int i = leaf.first; i < leaf.first + leaf.count; ++i) {
+                if (prim_indices[i] == skip) continue;
+                float t = spheres[prim_indices[i]].intersect(ray);
+                if (t > 0 && t < t_limit) return blocked = true;
+            }
+            return false;
+        });
+        return blocked;
+    }
+    
+    // Closest sphere surface to p no farther than distance; returns the primitive or -1 and
+    // leaves the surface distance in distance. Nearer children are searched first and
+    // boxes farther than the best distance so far are skipped.
+    int nearest(const std::vector<Sphere>& spheres, const Vec3& p, float& distance) const {
+        int best = -1;
+        if (root < 0 || nodes[root].bounds.distance(p) > distance) return best;
+        std::vector<int> stack(1, root);
+        while (!stack.empty()) {
+            const BVHNode& node = nodes[stack.back()];
+            stack.pop_back();
+            if (node.bounds.distance(p) > distance) continue;
+            if (node.isLeaf()) {
+                for (int i = node.first; i < node.first + node.count; ++i) {
+                    const Sphere& sphere = spheres[prim_indices[i]];
+                    Vec3 offset = p - sphere.center;
+                    float d = std::abs(sqrt(offset.dot(offset)) - sphere.radius);
+                    if (d < distance) {
+                        distance = d;
+                        best = prim_indices[i];
+                    }
+                }
+                continue;
+            }
+            float left = nodes[node.left].bounds.distance(p), right = nodes[node.right].bounds.distance(p);
+            int near = left <= right ? node.left : node.right;
+            stack.push_back(near == node.left ? node.right : node.left);
+            stack.push_back(near);
+        }
+        return best;
+    }
+    
+    // Walk every leaf some lane of the packet enters before its t_max, in the near-child
+    // order of lane 0. leaf_fn(leaf, active) sees which lanes hit the leaf box, may shrink
+    // or retire (negative) lane limits and returns true to stop the walk.
+    template <typename LeafFn>
+    void traversePacket(RayPacket& packet, LeafFn&& leaf_fn) const {
+        if (root < 0) return;
+        int stack[kStackSize];
+        int top = 0;
+        stack[top++] = root;
+        int active[RayPacket::kSize];
+        while (top > 0) {
+            const BVHNode& node = nodes[stack[--top]];
+            if (!packet.intersect(node.bounds, active)) continue;
+            if (node.isLeaf()) {
+                if (leaf_fn(node, active)) return;
+            } else {
+                int near = packet.sign[node.axis] ? node.right : node.left;
+                stack[top++] = near == node.left ? node.right : node.left;
+                stack[top++] = near;
+            }
+        }
+    }
+    
+    // Walk every leaf whose box the ray enters before t_max, near child first. The leaf
+    // callback may shrink t_max and returns true to stop the walk.
+    template <typename LeafFn>
+    void traverse(const Ray& ray, float& t_max, LeafFn&& leaf_fn) const {
+        if (root < 0) return;
+        switch (traversal) {
+            case BvhTraversal::Stack: traverseStack(ray, t_max, leaf_fn); break;
+            case BvhTraversal::ShortStack: traverseShortStack(ray, t_max, leaf_fn); break;
+            case BvhTraversal::Stackless: traverseStackless(ray, t_max, leaf_fn); break;
+        }
+    }
+    
+private:
+    static constexpr int kStackSize = 128;
+    static constexpr int kShortStackSize = 4;
+    static constexpr float kTraversalCost = 1.0f;
+    static constexpr float kIntersectCost = 1.0f;
+    static constexpr int kMaxLeafSize = 4;
+    static constexpr int kBins = 16;
+    static constexpr int kParallelThreshold = 4096; // Primitives below which work stays on one thread
+    
+    std::vector<AABB> prim_bounds;
+    std::vector<int> prim_leaf;   // Leaf holding each primitive, for refits
+    int dead_nodes = 0;           // Entries of nodes unlinked by remove()
+    
+    // ---- Traversal kernels ----
+    //
+    // Interior nodes keep the child with the lower centroid on their split axis on the
+    // left, so the child a ray meets first follows from the ray's direction sign alone.
+    
+    int nearChild(const BVHNode& node, const Ray& ray) const {
+        return ray.sign[node.axis] ? node.right : node.left;
+    }
+    
+    int sibling(int index) const {
+        const BVHNode& parent = nodes[nodes[index].parent];
+        return parent.left == index ? parent.right : parent.left;
+    }
+    
+    void prefetchNode(int index) const {
+#if defined(__GNUC__)
+        __builtin_prefetch(&nodes[index]);
+#endif
+    }
+    
+    void refitLeaf(const std::vector<Sphere>& spheres, int index) {
+        BVHNode& leaf = nodes[index];
+        leaf.bounds = AABB();
+        for (int i = leaf.first; i < leaf.first + leaf.count; ++i) leaf.bounds.expand(sphereBounds(spheres[prim_indices[i]]));
+    }
+    
+    void refitAncestors(int index) {
+        for (int node = nodes[index].parent; node >= 0; node = nodes[node].parent) {
+            BVHNode& interior = nodes[node];
+            interior.bounds = nodes[interior.left].bounds;
+            interior.bounds.expand(nodes[interior.right].bounds);
+        }
+    }
+    
+    // Point parent's link to child old_child at new_child instead; parent -1 is the root link
+    void replaceChild(int parent, int old_child, int new_child) {
+        if (parent < 0) root = new_child;
+        else if (nodes[parent].left == old_child) nodes[parent].left = new_child;
+        else nodes[parent].right = new_child;
+    }
+    
+    // Surface area added to a by enclosing b
+    static float growth(const AABB& a, const AABB& b) {
+        AABB merged = a;
+        merged.expand(b);
+        return merged.surfaceArea() - a.surfaceArea();
+    }
+    
+    void orderChildren() {
+        for (auto& node : nodes) {
+            if (!node.isLeaf()) orderChildren(node);
+        }
+    }
+    
+    void orderChildren(BVHNode& node) {
+        Vec3 d = nodes[node.right].bounds.centroid() - nodes[node.left].bounds.centroid();
+        float extent[3] = {d.x, d.y, d.z};
+        int axis = 0;
+        for (int a = 1; a < 3; ++a) if (fabs(extent[a]) > fabs(extent[axis])) axis = a;
+        node.axis = axis;
+        if (extent[axis] < 0) std::swap(node.left, node.right);
+    }
+    
+    // Full per-ray stack; the reference kernel
+    template <typename LeafFn>
+    void traverseStack(const Ray& ray, float& t_max, LeafFn& leaf_fn) const {
+        int stack[kStackSize];
+        int top = 0;
+        stack[top++] = root;
+        while (top > 0) {
+            const BVHNode& node = nodes[stack[--top]];
+            if (!node.bounds.intersect(ray, t_max)) continue;
+            if (node.isLeaf()) {
+                if (leaf_fn(node, t_max)) return;
+            } else {
+                int near = nearChild(node, ray);
+                int far = near == node.left ? node.right : node.left;
+                prefetchNode(far);
+                prefetchNode(near);
+                stack[top++] = far;
+                stack[top++] = near;
+            }
+        }
+    }
+    
+    // Ring buffer of kShortStackSize entries. Overflow drops the oldest (highest) far
+    // children; once the stack runs dry after an overflow, the walk resumes from the last
+    // visited node by climbing parent pointers to the next unvisited far sibling.
+    template <typename LeafFn>
+    void traverseShortStack(const Ray& ray, float& t_max, LeafFn& leaf_fn) const {
+        int stack[kShortStackSize];
+        int top = 0, size = 0;
+        bool overflowed = false;
+        int current = root;
+        while (true) {
+            const BVHNode& node = nodes[current];
+            int last = current;
+            current = -1;
+            if (node.bounds.intersect(ray, t_max)) {
+                if (node.isLeaf()) {
+                    if (leaf_fn(node, t_max)) return;
+                } else {
+                    current = nearChild(node, ray);
+                    int far = current == node.left ? node.right : node.left;
+                    prefetchNode(current);
+                    prefetchNode(far);
+                    stack[top] = far;
+                    top = (top + 1) % kShortStackSize;
+                    if (size == kShortStackSize) overflowed = true;
+                    else ++size;
+                }
+            }
+            if (current >= 0) continue;
+            if (size > 0) {
+                top = (top + kShortStackSize - 1) % kShortStackSize;
+                --size;
+                current = stack[top];
+                continue;
+            }
+            if (!overflowed) return;
+            
+            // Restart: climb until we leave a near child whose far sibling is still pending
+            while (last != root) {
+                int parent = nodes[last].parent;
+                if (nearChild(nodes[parent], ray) == last) {
+                    current = sibling(last);
+                    break;
+                }
+                last = parent;
+            }
+            if (current < 0) return;
+        }
+    }
+    
+    // Parent-pointer traversal without any stack (Hapala et al. 2011): the state records
+    // whether the current node was reached from its parent, its sibling or one of its children.
+    template <typename LeafFn>
+    void traverseStackless(const Ray& ray, float& t_max, LeafFn& leaf_fn) const {
+        if (nodes[root].isLeaf()) {
+            if (nodes[root].bounds.intersect(ray, t_max)) leaf_fn(nodes[root], t_max);
+            return;
+        }
+        enum State { FromParent, FromSibling, FromChild };
+        int current = nearChild(nodes[root], ray);
+        State state = FromParent;
+        while (true) {
+            const BVHNode& node = nodes[current];
+            switch (state) {
+                case FromChild: {
+                    if (current == root) return;
+                    int parent = node.parent;
+                    if (nearChild(nodes[parent], ray) == current) {
+                        current = sibling(current);
+                        state = FromSibling;
+                    } else {
+                        current = parent;
+                        state = FromChild;
+                    }
+                    break;
+                }
+                case FromSibling:
+                case FromParent: {
+                    bool descend = false;
+                    if (node.bounds.intersect(ray, t_max)) {
+                        if (node.isLeaf()) {
+                            if (leaf_fn(node, t_max)) return;
+                        } else {
+                            descend = true;
+                        }
+                    }
+                    if (descend) {
+                        current = nearChild(node, ray);
+                        prefetchNode(current == node.left ? node.right : node.left);
+                        state = FromParent;
+                    } else if (state == FromParent) {
+                        current = sibling(current);
+                        state = FromSibling;
+                    } else {
+                        current = node.parent;
+                        state = FromChild;
+                    }
+                    break;
+                }
+            }
+        }
+    }
+    
+    // ---- LBVH (Karras 2012) ----
+    
+    static uint32_t expandBits(uint32_t v) {
+        v = (v * 0x00010001u) & 0xFF0000FFu;
+        v = (v * 0x00000101u) & 0x0F00F00Fu;
+        v = (v * 0x00000011u) & 0xC30C30C3u;
+        v = (v * 0x00000005u) & 0x49249249u;
+        return v;
+    }
+    
+    static uint32_t morton3D(const Vec3& p) {
+        auto quantize = [](float f) { return (uint32_t)std::min(1023.0f, std::max(0.0f, f * 1024.0f)); };
+        return (expandBits(quantize(p.x)) << 2) | (expandBits(quantize(p.y)) << 1) | expandBits(quantize(p.z));
+    }
+    
+    // Stable LSD radix sort of (code, index) pairs, 8 bits per pass with per-thread histograms
+    static void radixSort(std::vector<uint32_t>& codes, AlignedVector<int, MemoryTag::Accel>& indices, int threads) {
+        int n = (int)codes.size();
+        int workers = n < kParallelThreshold ? 1 : threads;
+        int chunk = (n + workers - 1) / workers;
+        std::vector<uint32_t> codes_tmp(n);
+        AlignedVector<int, MemoryTag::Accel> indices_tmp(n);
+        std::vector<int> histograms(workers * 256);
+        for (int shift = 0; shift < 32; shift += 8) {
+            std::fill(histograms.begin(), histograms.end(), 0);
+            parallelFor(workers, workers, [&](int w) {
+                int* histogram = &histograms[w * 256];
+                for (int i = w * chunk; i < std::min(n, (w + 1) * chunk); ++i) histogram[(codes[i] >> shift) & 0xFF]++;
+            });
+            // Exclusive prefix over (digit, worker) so equal digits keep their input order
+            int sum = 0;
+            for (int digit = 0; digit < 256; ++digit) {
+                for (int w = 0; w < workers; ++w) {
+                    int c = histograms[w * 256 + digit];
+                    histograms[w * 256 + digit] = sum;
+                    sum += c;
+                }
+            }
+            parallelFor(workers, workers, [&](int w) {
+                int* offsets = &histograms[w * 256];
+                for (int i = w * chunk; i < std::min(n, (w + 1) * chunk); ++i) {
+                    int dst = offsets[(codes[i] >> shift) & 0xFF]++;
+                    codes_tmp[dst] = codes[i];
+                    indices_tmp[dst] = indices[i];
+                }
+            });
+            codes.swap(codes_tmp);
+            indices.swap(indices_tmp);
+        }
+    }
+    
+    void buildLBVH(int threads) {
+        int n = (int)prim_bounds.size();
+        int workers = n < kParallelThreshold ? 1 : threads;
+        AABB centroid_bounds;
+        for (const auto& b : prim_bounds) centroid_bounds.expand(b.centroid());
+        Vec3 extent = centroid_bounds.hi - centroid_bounds.lo;
+        Vec3 inv_extent(extent.x > 0 ? 1.0f / extent.x : 0.0f, extent.y > 0 ? 1.0f / extent.y : 0.0f,
+                        extent.z > 0 ? 1.0f / extent.z : 0.0f);
+        
+        std::vector<uint32_t> codes(n);
+        parallelFor(n, workers, [&](int i) {
+            Vec3 c = prim_bounds[i].centroid() - centroid_bounds.lo;
+            codes[i] = morton3D(Vec3(c.x * inv_extent.x, c.y * inv_extent.y, c.z * inv_extent.z));
+        });
+        radixSort(codes, prim_indices, threads);
+        
+        // Internal nodes occupy [0, n - 1), single-primitive leaves [n - 1, 2n - 1)
+        nodes.assign(2 * n - 1, BVHNode());
+        for (int i = 0; i < n; ++i) {
+            BVHNode& leaf = nodes[n - 1 + i];
+            leaf.first = i;
+            leaf.count = 1;
+            leaf.bounds = prim_bounds[prim_indices[i]];
+        }
+        root = 0;
+        if (n == 1) return;
+        
+        // Length of the common prefix of sorted keys i and j, with the index breaking ties
+        auto delta = [&](int i, int j) -> int {
+            if (j < 0 || j >= n) return -1;
+            if (codes[i] == codes[j]) return 32 + __builtin_clz((uint32_t)(i ^ j));
+            return __builtin_clz(codes[i] ^ codes[j]);
+        };
+        
+        parallelFor(n - 1, workers, [&](int i) {
+            int d = delta(i, i + 1) - delta(i, i - 1) >= 0 ? 1 : -1;
+            int delta_min = delta(i, i - d);
+            int l_max = 2;
+            while (delta(i, i + l_max * d) > delta_min) l_max *= 2;
+            int l = 0;
+            for (int t = l_max / 2; t >= 1; t /= 2) {
+                if (delta(i, i + (l + t) * d) > delta_min) l += t;
+            }
+            int j = i + l * d;
+            int delta_node = delta(i, j);
+            int s = 0;
+            int t = l;
+            do {
+                t = (t + 1) >> 1;
+                if (delta(i, i + (s + t) * d) > delta_node) s += t;
+            } while (t > 1);
+            int gamma = i + s * d + std::min(d, 0);
+            
+            BVHNode& node = nodes[i];
+            node.left = std::min(i, j) == gamma ? n - 1 + gamma : gamma;
+            node.right = std::max(i, j) == gamma + 1 ? n - 1 + gamma + 1 : gamma + 1;
+            nodes[node.left].parent = i;
+            nodes[node.right].parent = i;
+        });
+        
+        // Bounds bottom-up: the second child to arrive at a node finishes it
+        std::unique_ptr<std::atomic<int>[]> arrivals(new std::atomic<int>[n - 1]);
+        for (int i = 0; i < n - 1; ++i) arrivals[i].store(0, std::memory_order_relaxed);
+        parallelFor(n, workers, [&](int i) {
+            int node = nodes[n - 1 + i].parent;
+            while (node >= 0) {
+                if (arrivals[node].fetch_add(1, std::memory_order_acq_rel) == 0) break;
+                BVHNode& current = nodes[node];
+                current.bounds = nodes[current.left].bounds;
+                current.bounds.expand(nodes[current.right].bounds);
+                node = current.parent;
+            }
+        });
+    }
+    
+    // ---- Binned SAH ----
+    
+    void buildBinnedSAH(int threads) {
+        int n = (int)prim_bounds.size();
+        nodes.assign(2 * n - 1, BVHNode());
+        std::atomic<int> node_count(1);
+        std::atomic<int> spare_threads(threads - 1);
+        root = 0;
+        buildSAHRecursive(0, 0, n, node_count, spare_threads);
+        nodes.resize(node_count.load());
+    }
+    
+    void buildSAHRecursive(int node_index, int begin, int end, std::atomic<int>& node_count,
+                           std::atomic<int>& spare_threads) {
+        BVHNode& node = nodes[node_index];
+        AABB bounds, centroid_bounds;
+        for (int i = begin; i < end; ++i) {
+            bounds.expand(prim_bounds[prim_indices[i]]);
+            centroid_bounds.expand(prim_bounds[prim_indices[i]].centroid());
+        }
+        node.bounds = bounds;
+        int count = end - begin;
+        
+        // Best split over all three axes
+        float best_cost = 1e30f;
+        int best_axis = -1, best_split = 0;
+        float leaf_cost = kIntersectCost * count;
+        if (count > 1) {
+            for (int axis = 0; axis < 3; ++axis) {
+                float lo = axis == 0 ? centroid_bounds.lo.x : axis == 1 ? centroid_bounds.lo.y : centroid_bounds.lo.z;
+                float hi = axis == 0 ? centroid_bounds.hi.x : axis == 1 ? centroid_bounds.hi.y : centroid_bounds.hi.z;
+                if (hi <= lo) continue;
+                AABB bin_bounds[kBins];
+                int bin_counts[kBins] = {};
+                float scale = kBins / (hi - lo);
+                for (int i = begin; i < end; ++i) {
+                    int bin = binIndex(prim_bounds[prim_indices[i]].centroid(), axis, lo, scale);
+                    bin_counts[bin]++;
+                    bin_bounds[bin].expand(prim_bounds[prim_indices[i]]);
+                }
+                // Sweep from the right, then evaluate each split from the left
+                float right_area[kBins];
+                int right_count[kBins];
+                AABB accumulated;
+                int accumulated_count = 0;
+                for (int b = kBins - 1; b > 0; --b) {
+                    accumulated.expand(bin_bounds[b]);
+                    accumulated_count += bin_counts[b];
+                    right_area[b] = accumulated.surfaceArea();
+                    right_count[b] = accumulated_count;
+                }
+                accumulated = AABB();
+                accumulated_count = 0;
+                for (int b = 0; b < kBins - 1; ++b) {
+                    accumulated.expand(bin_bounds[b]);
+                    accumulated_count += bin_counts[b];
+                    if (accumulated_count == 0 || right_count[b + 1] == 0) continue;
+                    float cost = kTraversalCost + kIntersectCost *
+                        (accumulated.surfaceArea() * accumulated_count + right_area[b + 1] * right_count[b + 1]) /
+                        std::max(1e-12f, bounds.surfaceArea());
+                    if (cost < best_cost) {
+                        best_cost = cost;
+                        best_axis = axis;
+                        best_split = b;
+                    }
+                }
+            }
+        }
+        
+        if (best_axis < 0 || (count <= kMaxLeafSize && leaf_cost <= best_cost)) {
+            if (best_axis < 0 && count > kMaxLeafSize) {
+                // Coincident centroids: split the range in half
+                best_axis = 0;
+                best_split = -1;
+            } else {
+                node.first = begin;
+                node.count = count;
+                return;
+            }
+        }
+        
+        int mid;
+        if (best_split < 0) {
+            mid = begin + count / 2;
+        } else {
+            float lo = best_axis == 0 ? centroid_bounds.lo.x : best_axis == 1 ? centroid_bounds.lo.y : centroid_bounds.lo.z;
+            float hi = best_axis == 0 ? centroid_bounds.hi.x : best_axis == 1 ? centroid_bounds.hi.y : centroid_bounds.hi.z;
+            float scale = kBins / (hi - lo);
+            int* split = std::partition(prim_indices.data() + begin, prim_indices.data() + end, [&](int prim) {
+                return binIndex(prim_bounds[prim].centroid(), best_axis, lo, scale) <= best_split;
+            });
+            mid = (int)(split - prim_indices.data());
+        }
+        
+        int left = node_count.fetch_add(2);
+        node.left = left;
+        node.right = left + 1;
+        nodes[left].parent = node_index;
+        nodes[left + 1].parent = node_index;
+        
+        // Large subtrees go to another thread while this one continues with the right half
+        if (count >= kParallelThreshold && spare_threads.fetch_sub(1) > 0) {
+            std::thread worker([&, left, begin, mid] {
+                buildSAHRecursive(left, begin, mid, node_count, spare_threads);
+            });
+            buildSAHRecursive(left + 1, mid, end, node_count, spare_threads);
+            worker.join();
+            spare_threads.fetch_add(1);
+        } else {
+            if (count >= kParallelThreshold) spare_threads.fetch_add(1);
+            buildSAHRecursive(left, begin, mid, node_count, spare_threads);
+            buildSAHRecursive(left + 1, mid, end, node_count, spare_threads);
+        }
+    }
+    
+    static int binIndex(const Vec3& c, int axis, float lo, float scale) {
+        float v = axis == 0 ? c.x : axis == 1 ? c.y : c.z;
+        return std::min(kBins - 1, std::max(0, (int)((v - lo) * scale)));
+    }
+    
+    // ---- Treelet restructuring (Karras & Aila 2013) ----
+    //
+    // Bottom-up, every interior node roots a treelet grown to at most 7 leaves by expanding
+    // the largest-area leaf. Dynamic programming over leaf subsets then finds the topology
+    // with minimal SAH cost, reusing the treelet's interior nodes.
+    
+    static constexpr int kTreeletLeaves = 7;
+    
+    float nodeCost(int index, const std::vector<float>& cost) const {
+        const BVHNode& node = nodes[index];
+        return node.isLeaf() ? kIntersectCost * node.count * node.bounds.surfaceArea() : cost[index];
+    }
+    
+    void optimizeTreelets(int threads) {
+        int node_total = (int)nodes.size();
+        if (node_total < 3) return;
+        std::vector<float> cost(node_total, 0.0f);
+        std::vector<int> leaves;
+        for (int i = 0; i < node_total; ++i) if (nodes[i].isLeaf()) leaves.push_back(i);
+        
+        std::unique_ptr<std::atomic<int>[]> arrivals(new std::atomic<int>[node_total]);
+        for (int i = 0; i < node_total; ++i) arrivals[i].store(0, std::memory_order_relaxed);
+        int workers = (int)leaves.size() < kParallelThreshold ? 1 : threads;
+        parallelFor((int)leaves.size(), workers, [&](int i) {
+            int node = nodes[leaves[i]].parent;
+            while (node >= 0) {
+                if (arrivals[node].fetch_add(1, std::memory_order_acq_rel) == 0) break;
+                restructureTreelet(node, cost);
+                node = nodes[node].parent;
+            }
+        });
+    }
+    
+    void restructureTreelet(int root_index, std::vector<float>& cost) {
+        // Grow the treelet
+        int treelet_leaves[kTreeletLeaves];
+        int leaf_count = 2;
+        treelet_leaves[0] = nodes[root_index].left;
+        treelet_leaves[1] = nodes[root_index].right;
+        int internal[kTreeletLeaves - 1];
+        int internal_count = 0;
+        internal[internal_count++] = root_index;
+        while (leaf_count < kTreeletLeaves) {
+            int best = -1;
+            float best_area = -1.0f;
+            for (int i = 0; i < leaf_count; ++i) {
+                const BVHNode& candidate = nodes[treelet_leaves[i]];
+                if (!candidate.isLeaf() && candidate.bounds.surfaceArea() > best_area) {
+                    best_area = candidate.bounds.surfaceArea();
+                    best = i;
+                }
+            }
+            if (best < 0) break;
+            int expanded = treelet_leaves[best];
+            internal[internal_count++] = expanded;
+            treelet_leaves[best] = nodes[expanded].left;
+            treelet_leaves[leaf_count++] = nodes[expanded].right;
+        }
+        
+        // Optimal SAH cost and split for every subset of treelet leaves
+        int subsets = 1 << leaf_count;
+        float area[1 << kTreeletLeaves];
+        float best_cost[1 << kTreeletLeaves];
+        int best_partition[1 << kTreeletLeaves];
+        for (int mask = 1; mask < subsets; ++mask) {
+            AABB bounds;
+            for (int i = 0; i < leaf_count; ++i) if (mask & (1 << i)) bounds.expand(nodes[treelet_leaves[i]].bounds);
+            area[mask] = bounds.surfaceArea();
+        }
+        for (int i = 0; i < leaf_count; ++i) best_cost[1 << i] = nodeCost(treelet_leaves[i], cost);
+        for (int mask = 1; mask < subsets; ++mask) {
+            if ((mask & (mask - 1)) == 0) continue;
+            float best = 1e30f;
+            int best_p = 0;
+            // Enumerate partitions with the lowest leaf on the left to skip mirror images
+            int lowest = mask & -mask;
+            for (int p = (mask - 1) & mask; p > 0; p = (p - 1) & mask) {
+                if (!(p & lowest)) continue;
+                float c = best_cost[p] + best_cost[mask ^ p];
+                if (c < best) {
+                    best = c;
+                    best_p = p;
+                }
+            }
+            best_cost[mask] = kTraversalCost * area[mask] + best;
+            best_partition[mask] = best_p;
+        }
+        
+        // Rebuild the treelet from the stored partitions, reusing interior nodes
+        int next_internal = 1;
+        std::function<int(int, int)> emit = [&](int mask, int index) -> int {
+            if ((mask & (mask - 1)) == 0) {
+                for (int i = 0; i < leaf_count; ++i) if (mask == (1 << i)) return treelet_leaves[i];
+            }
+            if (index < 0) index = internal[next_internal++];
+            int p = best_partition[mask];
+            int left = emit(p, -1);
+            int right = emit(mask ^ p, -1);
+            BVHNode& node = nodes[index];
+            node.left = left;
+            node.right = right;
+            node.count = 0;
+            nodes[left].parent = index;
+            nodes[right].parent = index;
+            node.bounds = nodes[left].bounds;
+            node.bounds.expand(nodes[right].bounds);
+            cost[index] = kTraversalCost * node.bounds.surfaceArea() + nodeCost(left, cost) + nodeCost(right, cost);
+            return index;
+        };
+        emit(subsets - 1, root_index);
+    }
+};
+
+// Order in which tiles, and pixels within a tile, are visited
+enum class PixelOrder { Scanline, Morton, Hilbert };
+
+inline const char* pixelOrderName(PixelOrder order) {
+    switch (order) {
+        case PixelOrder::Scanline: return "scanline";
+        case PixelOrder::Morton: return "Morton";
+        case PixelOrder::Hilbert: return "Hilbert";
+    }
+    return "";
+}
+
+// Position d along the Hilbert curve filling an n x n square (n a power of two)
+inline void hilbertPoint(int n, int d, int& x, int& y) {
+    x = y = 0;
+    for (int s = 1; s < n; s *= 2) {
+        int rx = 1 & (d / 2);
+        int ry = 1 & (d ^ rx);
+        if (ry == 0) {
+            if (rx == 1) {
+                x = s - 1 - x;
+                y = s - 1 - y;
+            }
+            std::swap(x, y);
+        }
+        x += s * rx;
+        y += s * ry;
+        d /= 4;
+    }
+}
+
+// Every cell of a w x h grid in the given order, packed as (y << 16) | x. The curves are
+// laid over the enclosing power-of-two square and clipped to the grid.
+inline std::vector<uint32_t> curveOrder(int w, int h, PixelOrder order) {
+    std::vector<uint32_t> cells;
+    cells.reserve(w * h);
+    if (order == PixelOrder::Scanline) {
+        for (int y = 0; y < h; ++y)
+            for (int x = 0; x < w; ++x) cells.push_back((uint32_t)y << 16 | x);
+        return cells;
+    }
+    int n = 1;
+    while (n < std::max(w, h)) n *= 2;
+    for (int d = 0; d < n * n; ++d) {
+        int x = 0, y = 0;
+        if (order == PixelOrder::Morton) {
+            for (int bit = 0; (1 << bit) < n; ++bit) {
+                x |= ((d >> (2 * bit)) & 1) << bit;
+                y |= ((d >> (2 * bit + 1)) & 1) << bit;
+            }
+        } else {
+            hilbertPoint(n, d, x, y);
+        }
+        if (x < w && y < h) cells.push_back((uint32_t)y << 16 | x);
+    }
+    return cells;
+}
+
+// Screen-space work item of the tile scheduler
+struct Tile {
+    int x0, y0, x1, y1;
+    float predicted;   // Cost expected from the previous frames (ns)
+    float measured;    // Cost measured this frame (ns)
+};
+
+// Cost-predictive tile scheduler. Per-cell render times from the previous frames predict
+// the cost of every base tile; tiles expected to take more than a fair share of a worker's
+// frame are split into quadrants, and the resulting list is handed out longest-first with
+// one atomic increment per tile. The expensive work starts early, so the frame ends with
+// small, cheap tiles instead of one thread finishing a glass sphere on its own.
+//
+// Tiles of the same power-of-two cost class keep space-filling-curve order, and pixels
+// inside a tile follow the same curve, so consecutive rays share BVH nodes and texels.
+class TileScheduler {
+public:
+    int base_size = 32;   // Pixels per base tile side
+    int cell_size = 8;    // Granularity of the cost history and smallest subdivided tile
+    PixelOrder order = PixelOrder::Hilbert;
+    
+    // Balance of the last frame: mean worker busy time over the longest one
+    float balance = 1.0f;
+    
+    // Call fn(x, y) for every pixel of a tile in the configured order
+    template <typename Fn>
+    void forEachPixel(const Tile& tile, Fn&& fn) const {
+        const std::vector<uint32_t>& cells = curves.at(curveKey(tile.x1 - tile.x0, tile.y1 - tile.y0));
+        for (uint32_t cell : cells) fn(tile.x0 + (int)(cell & 0xFFFF), tile.y0 + (int)(cell >> 16));
+    }
+    
+    // Call fn(tile) for tiles covering the width x height frame across the given threads
+    template <typename Fn>
+    void run(int width, int height, int threads, Fn&& fn) {
+        resize(width, height);
+        buildWork(threads);
+        
+        std::atomic<int> next(0);
+        std::vector<double> busy(threads, 0.0);
+        auto worker = [&](int w) {
+            for (int i = next.fetch_add(1, std::memory_order_relaxed); i < (int)work.size();
+                 i = next.fetch_add(1, std::memory_order_relaxed)) {
+                auto start = std::chrono::steady_clock::now();
+                fn(work[i]);
+                work[i].measured = std::chrono::duration<float, std::nano>(std::chrono::steady_clock::now() - start).count();
+                busy[w] += work[i].measured;
+            }
+        };
+        if (threads <= 1) {
+            worker(0);
+        } else {
+            std::vector<std::thread> workers;
+            for (int w = 0; w < threads; ++w) workers.emplace_back(worker, w);
+            for (auto& t : workers) t.join();
+        }
+        
+        // Spread each tile's time over its cells, smoothed against the history
+        std::vector<float> frame_cost(cell_cost.size(), 0.0f);
+        for (const Tile& tile : work) {
+            int cx0 = tile.x0 / cell_size, cx1 = (tile.x1 + cell_size - 1) / cell_size;
+            int cy0 = tile.y0 / cell_size, cy1 = (tile.y1 + cell_size - 1) / cell_size;
+            float share = tile.measured / ((cx1 - cx0) * (cy1 - cy0));
+            for (int cy = cy0; cy < cy1; ++cy)
+                for (int cx = cx0; cx < cx1; ++cx) frame_cost[cy * cells_x + cx] = share;
+        }
+        for (size_t i = 0; i < cell_cost.size(); ++i) cell_cost[i] = 0.5f * (cell_cost[i] + frame_cost[i]);
+        
+        double longest = *std::max_element(busy.begin(), busy.end());
+        double mean = 0.0;
+        for (double b : busy) mean += b / threads;
+        balance = longest > 0.0 ? (float)(mean / longest) : 1.0f;
+    }
+    
+private:
+    int frame_width = 0, frame_height = 0;
+    int cells_x = 0, cells_y = 0;
+    std::vector<float> cell_cost;
+    std::vector<Tile> work;
+    PixelOrder curves_order = PixelOrder::Scanline;
+    std::map<uint32_t, std::vector<uint32_t>> curves;   // Pixel order per tile size
+    
+    static uint32_t curveKey(int w, int h) { return (uint32_t)w << 16 | h; }
+    
+    void resize(int width, int height) {
+        if (curves_order != order) {
+            curves.clear();
+            curves_order = order;
+        }
+        if (width == frame_width && height == frame_height) return;
+        frame_width = width;
+        frame_height = height;
+        cells_x = (width + cell_size - 1) / cell_size;
+        cells_y = (height + cell_size - 1) / cell_size;
+        cell_cost.assign(cells_x * cells_y, 1.0f); // Uniform until the first frame is measured
+    }
+    
+    float predict(int x0, int y0, int x1, int y1) const {
+        float cost = 0.0f;
+        for (int cy = y0 / cell_size; cy < (y1 + cell_size - 1) / cell_size; ++cy)
+            for (int cx = x0 / cell_size; cx < (x1 + cell_size - 1) / cell_size; ++cx) cost += cell_cost[cy * cells_x + cx];
+        return cost;
+    }
+    
+    void split(int x0, int y0, int x1, int y1, float target) {
+        float cost = predict(x0, y0, x1, y1);
+        int half_w = (x1 - x0) / 2, half_h = (y1 - y0) / 2;
+        if (cost <= target || half_w < cell_size || half_h < cell_size) {
+            work.push_back({x0, y0, x1, y1, cost, 0.0f});
+            return;
+        }
+        // Keep the quadrant edges on cell boundaries so predictions stay exact
+        int mx = x0 + half_w / cell_size * cell_size, my = y0 + half_h / cell_size * cell_size;
+        split(x0, y0, mx, my, target);
+        split(mx, y0, x1, my, target);
+        split(x0, my, mx, y1, target);
+        split(mx, my, x1, y1, target);
+    }
+    
+    void buildWork(int threads) {
+        float total = 0.0f;
+        for (float c : cell_cost) total += c;
+        // A tile may take at most a quarter of a worker's fair share of the frame
+        float target = total / (threads * 4);
+        work.clear();
+        int tiles_x = (frame_width + base_size - 1) / base_size, tiles_y = (frame_height + base_size - 1) / base_size;
+        for (uint32_t base : curveOrder(tiles_x, tiles_y, order)) {
+            int x = (int)(base & 0xFFFF) * base_size, y = (int)(base >> 16) * base_size;
+            split(x, y, std::min(frame_width, x + base_size), std::min(frame_height, y + base_size), target);
+        }
+        
+        // Longest-first by cost class; the stable sort keeps curve order within a class
+        auto cost_class = [](const Tile& tile) { return tile.predicted > 0.0f ? ilogbf(tile.predicted) : INT_MIN; };
+        std::stable_sort(work.begin(), work.end(), [&](const Tile& a, const Tile& b) { return cost_class(a) > cost_class(b); });
+        
+        // Pixel orders for every tile size are built here, before the workers read them
+        for (const Tile& tile : work) {
+            uint32_t key = curveKey(tile.x1 - tile.x0, tile.y1 - tile.y0);
+            if (!curves.count(key)) curves[key] = curveOrder(tile.x1 - tile.x0, tile.y1 - tile.y0, order);
+        }
+    }
+};
+
+// Deferred first-hit indirect term: the renderer adds weight * (filtered) radiance itself
+struct FirstHitGI {
+    bool valid = false;
+    Vec3 position, normal;
+    float footprint = 0.0f; // Ray cone width at the hit
+    Color weight;           // Albedo times GI strength
+    Color radiance;         // Traced incident GI sample
+};
+
+// Path-space filter: first-hit GI samples are pooled in a hashed grid of (position, normal)
+// cells so neighbouring pixels share each other's indirect estimates. Insertion and
+// accumulation are lock-free so render workers can write concurrently.
+class PathSpaceFilter {
+public:
+    struct Cell {
+        std::atomic<uint64_t> key;
+        std::atomic<int64_t> r, g, b;   // Fixed-point sums
+        std::atomic<uint32_t> count;
+    };
+    
+    explicit PathSpaceFilter(int capacity_log2 = 19)
+        : cells(size_t(1) << capacity_log2), mask((size_t(1) << capacity_log2) - 1) {
+        clear();
+    }
+    
+    size_t capacity() const { return mask + 1; }
+    
+    void clear() { clear(0, capacity()); }
+    
+    // Empty cells [begin, end), so several threads can clear the table in chunks
+    void clear(size_t begin, size_t end) {
+        for (size_t i = begin; i < end; ++i) {
+            cells[i].key.store(0, std::memory_order_relaxed);
+            cells[i].r.store(0, std::memory_order_relaxed);
+            cells[i].g.store(0, std::memory_order_relaxed);
+            cells[i].b.store(0, std::memory_order_relaxed);
+            cells[i].count.store(0, std::memory_order_relaxed);
+        }
+    }
+    
+    // Hash a world position and normal into a cell key. Cell sizes snap to powers of two
+    // so neighbouring pixels at similar depth agree on the grid.
+    static uint64_t cellKey(const Vec3& p, const Vec3& n, float cell_size) {
+        int level = (int)std::ceil(std::log2(std::max(cell_size, 1e-6f)));
+        float inv_size = std::ldexp(1.0f, -level);
+        uint64_t h = 1469598103934665603ull;
+        auto mix = [&h](int64_t v) {
+            h ^= (uint64_t)v;
+            h *= 1099511628211ull;
+            h ^= h >> 29;
+        };
+        mix((int64_t)std::floor(p.x * inv_size));
+        mix((int64_t)std::floor(p.y * inv_size));
+        mix((int64_t)std::floor(p.z * inv_size));
+        mix(level);
+        // Coarse normal buckets keep opposite-facing surfaces apart
+        mix((int)((n.x + 1.0f) * 1.5f) * 16 + (int)((n.y + 1.0f) * 1.5f) * 4 + (int)((n.z + 1.0f) * 1.5f));
+        return h | 1; // Zero marks an empty slot; probing starts from key >> 1, so every slot can be a home slot
+    }
+    
+    // Add a sample to the cell, claiming a slot by linear probing; returns the slot or -1
+    // when the table is too full around this key
+    int insert(uint64_t key, const Color& c) {
+        for (size_t probe = 0; probe < 32; ++probe) {
+            size_t slot = ((key >> 1) + probe) & mask;
+            uint64_t current = cells[slot].key.load(std::memory_order_relaxed);
+            if (current == 0 && cells[slot].key.compare_exchange_strong(current, key, std::memory_order_relaxed)) {
+                current = key;
+            }
+            if (current == key) {
+                atomicAdd(cells[slot].r, c.r);
+                atomicAdd(cells[slot].g, c.g);
+                atomicAdd(cells[slot].b, c.b);
+                cells[slot].count.fetch_add(1, std::memory_order_relaxed);
+                return (int)slot;
+            }
+        }
+        return -1;
+    }
+    
+    Color average(int slot) const {
+        const Cell& cell = cells[slot];
+        float inv = 1.0f / std::max(1u, cell.count.load(std::memory_order_relaxed));
+        return Color(fromFixedPoint(cell.r), fromFixedPoint(cell.g), fromFixedPoint(cell.b)) * inv;
+    }
+    
+private:
+    AlignedVector<Cell, MemoryTag::Cache> cells;
+    size_t mask;
+};
+
+// Hit-point cache for multi-view frames: the view-independent terms of a primary hit (light
+// visibility and the first-hit GI sample) are kept in a hashed grid of (position, normal)
+// cells, so other views landing on the same surface cell borrow them instead of tracing
+// their own shadow and GI rays. The first view fills the cells in one pass and the others
+// read them in the next; within a cell the lowest (pixel, sample) rank wins, so frames do
+// not depend on tile order. View-dependent reflection and refraction are never shared.
+class HitPointCache {
+public:
+    struct Entry {
+        int object = -1;       // Sphere index, so touching objects never share a cell
+        bool in_shadow = false;
+        bool has_gi = false;
+        Color gi;              // Traced first-hit GI radiance when has_gi
+    };
+    
+    struct Cell {
+        std::atomic<uint64_t> key;
+        std::atomic_flag lock;
+        uint64_t rank;
+        Entry entry;
+    };
+    
+    std::atomic<uint64_t> lookups, reuses;
+    
+    explicit HitPointCache(int capacity_log2 = 18)
+        : lookups(0), reuses(0), cells(size_t(1) << capacity_log2), mask((size_t(1) << capacity_log2) - 1) {
+        clear();
+    }
+    
+    size_t capacity() const { return mask + 1; }
+    
+    void clear() {
+        clear(0, capacity());
+        resetCounters();
+    }
+    
+    // Empty cells [begin, end), so several threads can clear the table in chunks
+    void clear(size_t begin, size_t end) {
+        for (size_t i = begin; i < end; ++i) {
+            cells[i].key.store(0, std::memory_order_relaxed);
+            cells[i].lock.clear(std::memory_order_relaxed);
+            cells[i].rank = UINT64_MAX;
+        }
+    }
+    
+    void resetCounters() {
+        lookups.store(0, std::memory_order_relaxed);
+        reuses.store(0, std::memory_order_relaxed);
+    }
+    
+    // Entry stored for this cell and object, or null. Only called once the writing pass is over.
+    const Entry* find(uint64_t key, int object) {
+        lookups.fetch_add(1, std::memory_order_relaxed);
+        for (size_t probe = 0; probe < 32; ++probe) {
+            const Cell& cell = cells[((key >> 1) + probe) & mask];
+            uint64_t current = cell.key.load(std::memory_order_relaxed);
+            if (current == 0) return nullptr;
+            if (current != key) continue;
+            if (cell.entry.object != object) return nullptr;
+            reuses.fetch_add(1, std::memory_order_relaxed);
+            return &cell.entry;
+        }
+        return nullptr;
+    }
+    
+    // Claim the cell by linear probing and keep the entry of the lowest rank
+    void store(uint64_t key, uint64_t rank, const Entry& entry) {
+        for (size_t probe = 0; probe < 32; ++probe) {
+            Cell& cell = cells[((key >> 1) + probe) & mask];
+            uint64_t current = cell.key.load(std::memory_order_relaxed);
+            if (current == 0 && cell.key.compare_exchange_strong(current, key, std::memory_order_relaxed)) {
+                current = key;
+            }
+            if (current != key) continue;
+            while (cell.lock.test_and_set(std::memory_order_acquire)) {}
+            if (rank < cell.rank) {
+                cell.rank = rank;
+                cell.entry = entry;
+            }
+            cell.lock.clear(std::memory_order_release);
+            return;
+        }
+    }
+    
+private:
+    AlignedVector<Cell, MemoryTag::Cache> cells;
+    size_t mask;
+};
+
+// Source of uniform random numbers for the bidirectional and Metropolis engines. Samplers
+// with several streams keep camera and light subpath numbers apart.
+struct Sampler {
+    virtual ~Sampler() {}
+    virtual float next() = 0;
+    virtual void startStream(int) {}
+};
+
+struct IndependentSampler : Sampler {
+    float next() override { return random01(); }
+};
+
+// Primary-sample-space Metropolis sampler (Kelemen et al.): the path is a deterministic
+// function of a vector of uniform numbers, which is mutated lazily by either a large step
+// (fresh numbers) or a small Gaussian perturbation, and restored when a proposal is rejected.
+class MLTSampler : public Sampler {
+public:
+    MLTSampler(const RandomStream& rng, int stream_count, float sigma = 0.01f, float large_step_probability = 0.3f)
+        : rng(rng), sigma(sigma), large_step_probability(large_step_probability),
+          stream_count(stream_count), stream_index(0), sample_index(0),
+          current_iteration(0), large_step(true), last_large_step_iteration(0) {}
+    
+    void startIteration() {
+        current_iteration++;
+        large_step = rng.next() < large_step_probability;
+    }
+    
+    void accept() {
+        if (large_step) last_large_step_iteration = current_iteration;
+    }
+    
+    void reject() {
+        for (auto& x : X) {
+            if (x.last_modification_iteration == current_iteration) {
+                x.value = x.value_backup;
+                x.last_modification_iteration = x.modify_backup;
+            }
+        }
+        current_iteration--;
+    }
+    
+    void startStream(int index) override {
+        stream_index = index;
+        sample_index = 0;
+    }
+    
+    float next() override {
+        size_t index = stream_index + stream_count * sample_index++;
+        ensureReady(index);
+        return X[index].value;
+    }
+    
+private:
+    struct PrimarySample {
+        float value = 0.0f;
+        int64_t last_modification_iteration = 0;
+        float value_backup = 0.0f;
+        int64_t modify_backup = 0;
+    };
+    
+    void ensureReady(size_t index) {
+        if (index >= X.size()) X.resize(index + 1);
+        PrimarySample& x = X[index];
+        
+        // Catch up on a large step this coordinate missed
+        if (x.last_modification_iteration < last_large_step_iteration) {
+            x.value = rng.next();
+            x.last_modification_iteration = last_large_step_iteration;
+        }
+        
+        x.value_backup = x.value;
+        x.modify_backup = x.last_modification_iteration;
+        if (large_step) {
+            x.value = rng.next();
+        } else {
+            // All small steps since the last touch collapse into one wider Gaussian
+            int64_t small_steps = current_iteration - x.last_modification_iteration;
+            x.value += normal() * sigma * sqrt((float)small_steps);
+            x.value -= std::floor(x.value);
+        }
+        x.last_modification_iteration = current_iteration;
+    }
+    
+    // Standard normal sample (Box-Muller)
+    float normal() {
+        float u1 = 1.0f - rng.next();
+        float u2 = rng.next();
+        return sqrt(-2.0f * std::log(u1)) * cos(2.0f * (float)M_PI * u2);
+    }
+    
+    RandomStream rng;
+    float sigma, large_step_probability;
+    int stream_count, stream_index;
+    size_t sample_index;
+    int64_t current_iteration;
+    bool large_step;
+    int64_t last_large_step_iteration;
+    std::vector<PrimarySample> X;
+};
+
+// Vertex of a camera or light subpath. Densities are per unit area: pdf_fwd is the density
+// of sampling this vertex from its predecessor, pdf_rev the density from the other direction.
+enum class VertexType { Camera, Light, Surface };
+
+struct PathVertex {
+    VertexType type = VertexType::Surface;
+    Vec3 p, n;
+    Vec3 wo;                     // Unit direction towards the previous vertex
+    const Sphere* sphere = nullptr;
+    Bsdf bsdf;
+    Color beta;                  // Path throughput up to this vertex
+    bool delta = false;          // Reached through a specular lobe
+    float pdf_fwd = 0.0f, pdf_rev = 0.0f;
+    
+    bool onSurface() const { return type == VertexType::Surface; }
+};
+
+enum class RenderEngine { Whitted, PathTrace, Bidirectional, Metropolis };
+
+// Stereo output: off, both eyes side by side in the window, or two full-resolution layers
+// (shown as a red/cyan anaglyph)
+enum class StereoLayout { Off, SideBySide, Layered };
+
+inline const char* stereoLayoutName(StereoLayout layout) {
+    switch (layout) {
+        case StereoLayout::Off: return "off";
+        case StereoLayout::SideBySide: return "side by side";
+        case StereoLayout::Layered: return "layered";
+    }
+    return "";
+}
+
+// One rung of the quality ladder. Only refine tiers render with the selected engine; the
+// others are Whitted previews with their own limits.
+struct QualityTier {
+    const char* name;
+    bool refine;     // Selected engine and the user's sample count
+    int samples;     // Whitted samples per pixel, 0 for the user's setting
+    int max_depth;   // Whitted recursion limit
+    bool gi;         // Whitted first-hit global illumination
+    int scale;       // Trace at 1/scale resolution and upscale
+};
+
+// Picks the tier of each frame from input recency and frame timing. While the user is
+// interacting, frames drop to the best tier whose smoothed cost fits the frame budget;
+// once input has been quiet for idle_delay the ladder is climbed one tier per frame up to
+// full quality, so every step is small and each tier's cost keeps being measured.
+// Input callbacks may run on another thread than the renderer, hence the atomic timestamp.
+class QualityGovernor {
+public:
+    using Clock = std::chrono::steady_clock;
+    
+    std::vector<QualityTier> tiers = {
+        {"preview", false, 1, 2, false, 2},
+        {"interactive", false, 1, 4, true, 1},
+        {"refine", true, 0, 8, true, 1},
+    };
+    float budget_ms = 33.0f;    // Target frame time under interaction
+    float idle_delay = 0.25f;   // Seconds without input before refining
+    bool enabled = true;
+    
+    QualityGovernor() : last_input(INT64_MIN / 2), current(-1), cost_ms(tiers.size(), 0.0f) {}
+    
+    void onInput() {
+        last_input.store(Clock::now().time_since_epoch().count(), std::memory_order_relaxed);
+    }
+    
+    bool interacting() const {
+        Clock::duration since = Clock::now().time_since_epoch() - Clock::duration(last_input.load(std::memory_order_relaxed));
+        return std::chrono::duration<float>(since).count() < idle_delay;
+    }
+    
+    // Tier index for the next frame
+    int select() {
+        int top = (int)tiers.size() - 1;
+        if (!enabled) return current = top;
+        if (!interacting()) return current = current < 0 ? top : std::min(current + 1, top);
+        
+        // Unmeasured tiers are assumed too slow; the idle ramp measures them
+        int fit = 0;
+        for (int i = 1; i <= top; ++i) {
+            if (cost_ms[i] > 0.0f && cost_ms[i] <= budget_ms) fit = i;
+        }
+        return current = current < 0 ? fit : std::min(current, fit);
+    }
+    
+    void record(int tier, float ms) {
+        cost_ms[tier] = cost_ms[tier] > 0.0f ? cost_ms[tier] * 0.8f + ms * 0.2f : ms;
+    }
+    
+private:
+    std::atomic<int64_t> last_input;   // Clock ticks since epoch
+    int current;                       // Tier of the previous frame, -1 before the first
+    std::vector<float> cost_ms;        // Smoothed frame time per tier
+};
+
+// Pinhole camera. The image plane sits at distance 1 along forward and spans [-1, 1] along
+// right; raster y grows downwards. The interactive view keeps the default basis and looks
+// down -z.
+struct Camera {
+    Vec3 position;
+    Vec3 right = Vec3(1, 0, 0), up = Vec3(0, 1, 0), forward = Vec3(0, 0, -1);
+    int width = 0, height = 0;
+    
+    Camera() = default;
+    Camera(const Vec3& position, int width, int height) : position(position), width(width), height(height) {}
+    
+    static Camera lookAt(const Vec3& position, const Vec3& target, int width, int height) {
+        Camera camera(position, width, height);
+        camera.forward = (target - position).normalize();
+        Vec3 world_up = std::abs(camera.forward.y) > 0.999f ? Vec3(0, 0, -1) : Vec3(0, 1, 0);
+        camera.right = camera.forward.cross(world_up).normalize();
+        camera.up = camera.right.cross(camera.forward);
+        return camera;
+    }
+    
+    // Ray through continuous raster position (raster_x, raster_y), where pixel x covers
+    // [x - 0.5, x + 0.5)
+    Ray ray(float raster_x, float raster_y) const {
+        float u = (raster_x / (float)width) * 2.0f - 1.0f;
+        float v = (raster_y / (float)height) * 2.0f - 1.0f;
+        v *= (float)height / width;
+        return Ray(position, right * u - up * v + forward);
+    }
+};
+
+// IEEE half conversion for G-buffer depth. Values below the smallest normal half (6e-5)
+// flush to zero and values past 65504 become infinity. Both directions are straight-line
+// selects, so loops over them vectorise.
+inline uint16_t floatToHalf(float value) {
+    uint32_t bits;
+    std::memcpy(&bits, &value, sizeof(bits));
+    uint32_t sign = (bits >> 16) & 0x8000;
+    uint32_t abs = bits & 0x7FFFFFFF;
+    uint32_t half = (abs - 0x38000000 + 0xFFF + ((abs >> 13) & 1)) >> 13;   // Rebias, round to nearest even
+    half = abs < 0x38800000 ? 0 : half;
+    half = abs >= 0x477FF000 ? 0x7C00 : half;
+    half = abs > 0x7F800000 ? 0x7E00 : half;   // NaN stays NaN
+    return (uint16_t)(sign | half);
+}
+
+inline float halfToFloat(uint16_t half) {
+    uint32_t exponent = half & 0x7C00;
+    uint32_t bits = (uint32_t)(half & 0x7FFF) << 13;
+    bits += exponent == 0x7C00 ? 224u << 23 : 112u << 23;   // Infinity and NaN keep an all-ones exponent
+    bits = exponent == 0 ? 0 : bits;
+    bits |= (uint32_t)(half & 0x8000) << 16;
+    float value;
+    std::memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+// Octahedral unit-vector encoding: the octahedron |x| + |y| + |z| = 1 is unfolded onto a
+// square, and the two coordinates stored as signed 16-bit fractions (error below 0.005 degrees).
+// The G-buffer codecs avoid selects between computed floats, libm rounding and sqrt: with
+// the default -ftrapping-math and -fmath-errno, g++ turns those into branches and leaves
+// the row loops scalar.
+inline void encodeOctahedral(const Vec3& n, int16_t& ox, int16_t& oy) {
+    float inv = 1.0f / (std::abs(n.x) + std::abs(n.y) + std::abs(n.z));
+    float x = n.x * inv, y = n.y * inv;
+    float fold_x = (1.0f - std::abs(y)) * std::copysign(1.0f, x);
+    float fold_y = (1.0f - std::abs(x)) * std::copysign(1.0f, y);
+    float lower = n.z < 0.0f ? 1.0f : 0.0f;   // Lower half folds over the edges
+    x += (fold_x - x) * lower;
+    y += (fold_y - y) * lower;
+    ox = (int16_t)(int)(x * 32767.0f + std::copysign(0.5f, x));   // Round half away from zero
+    oy = (int16_t)(int)(y * 32767.0f + std::copysign(0.5f, y));
+}
+
+inline Vec3 decodeOctahedral(int16_t ox, int16_t oy) {
+    float x = ox / 32767.0f, y = oy / 32767.0f;
+    float z = 1.0f - std::abs(x) - std::abs(y);
+    float fold = std::max(-z, 0.0f);
+    x -= std::copysign(fold, x);
+    y -= std::copysign(fold, y);
+    // Points of the octahedron have squared length l in [1/3, 1]: a quadratic fit of
+    // 1/sqrt(l) there and three Newton steps reach float precision
+    float l = x * x + y * y + z * z;
+    float inv = 2.1f - 1.6f * l + 0.5f * l * l;
+    for (int step = 0; step < 3; ++step) inv *= 1.5f - 0.5f * l * inv * inv;
+    return Vec3(x * inv, y * inv, z * inv);
+}
+
+// Compact G-buffer of primary hits for post-trace passes (reprojection, AOV display): 11
+// bytes per pixel instead of 36 for float normal, position and albedo. Each channel is a
+// plane of its own so a pass streams only what it reads:
+//   normal: octahedral, 2 x 16 bit
+//   depth:  distance to the first hit of the pixel's first (jittered) sample as a half,
+//           infinite for misses; positions are rebuilt from depth and the camera's
+//           pixel-centre ray, within half a pixel of the hit
+//   albedo: 8-bit RGB
+//   object: sphere index + 1 in 16 bits, 0 for misses; indices alias past 65535
+// Rows are encoded and decoded as a whole, in loops g++ -O3 vectorises (check with -fopt-info-vec).
+struct GBuffer {
+    Camera camera;
+    AlignedVector<int16_t, MemoryTag::Frame> normal;   // Two per pixel
+    AlignedVector<uint16_t, MemoryTag::Frame> depth;
+    AlignedVector<uint8_t, MemoryTag::Frame> albedo;   // Three per pixel
+    AlignedVector<uint16_t, MemoryTag::Frame> object;
+    
+    // Primary hit of one pixel as the tracer reports it
+    struct Hit {
+        float depth = INFINITY;
+        Vec3 normal = Vec3(0, 0, 1);
+        Color albedo;
+        int object = -1;   // -1 for misses
+    };
+    
+    // Unencoded pixels, staged by the tracer a row or a tile at a time
+    struct Row {
+        std::vector<float> depth;
+        std::vector<Vec3> normal;
+        std::vector<Color> albedo;
+        std::vector<int> object;
+        
+        explicit Row(int width) : depth(width, INFINITY), normal(width, Vec3(0, 0, 1)), albedo(width), object(width, -1) {}
+        
+        void set(int i, const Hit& hit) {
+            depth[i] = hit.depth;
+            normal[i] = hit.normal;
+            albedo[i] = hit.albedo;
+            object[i] = hit.object;
+        }
+    };
+    
+    void resize(const Camera& view) {
+        camera = view;
+        size_t pixels = (size_t)view.width * view.height;
+        normal.resize(pixels * 2);
+        depth.resize(pixels);
+        albedo.resize(pixels * 3);
+        object.resize(pixels);
+    }
+    
+    bool empty() const { return depth.empty(); }
+    
+    // [0, 1] to 8 bits, clamped after conversion so the float work stays branch-free
+    static uint8_t unorm8(float v) {
+        int i = (int)(v * 255.0f + 0.5f);
+        i = i > 0 ? i : 0;
+        return (uint8_t)(i < 255 ? i : 255);
+    }
+    
+    void clear() {
+        normal.clear();
+        depth.clear();
+        albedo.clear();
+        object.clear();
+    }
+    
+    void swap(GBuffer& other) {
+        std::swap(camera, other.camera);
+        normal.swap(other.normal);
+        depth.swap(other.depth);
+        albedo.swap(other.albedo);
+        object.swap(other.object);
+    }
+    
+    void encodeRow(int y, const Row& row) {
+        encodeSpan(y, 0, row, 0, camera.width);
+    }
+    
+    // Encode count staged pixels from row index first on into row y, starting at column x0
+    void encodeSpan(int y, int x0, const Row& row, int first, int count) {
+        size_t base = (size_t)y * camera.width + x0;
+        const float* in_depth = &row.depth[first];
+        const Vec3* in_normal = &row.normal[first];
+        const Color* in_albedo = &row.albedo[first];
+        const int* in_object = &row.object[first];
+        for (int x = 0; x < count; ++x) depth[base + x] = floatToHalf(in_depth[x]);
+        for (int x = 0; x < count; ++x) encodeOctahedral(in_normal[x], normal[(base + x) * 2], normal[(base + x) * 2 + 1]);
+        // Byte stores may alias anything, so the output pointer is hoisted
+        uint8_t* rgb = &albedo[base * 3];
+        for (int x = 0; x < count; ++x) {
+            rgb[x * 3] = unorm8(in_albedo[x].r);
+            rgb[x * 3 + 1] = unorm8(in_albedo[x].g);
+            rgb[x * 3 + 2] = unorm8(in_albedo[x].b);
+        }
+        for (int x = 0; x < count; ++x) object[base + x] = in_object[x] < 0 ? 0 : (uint16_t)(in_object[x] % 65535 + 1);
+    }
+    
+    // Row y of a buffer already resized to the full frame, copied from low by pixel
+    // replication the way renderScaled() upscales colour
+    void replicateRow(const GBuffer& low, int scale, int y) {
+        size_t base = (size_t)y * camera.width;
+        size_t low_base = (size_t)(y / scale) * low.camera.width;
+        for (int x = 0; x < camera.width; ++x) {
+            size_t from = low_base + x / scale;
+            depth[base + x] = low.depth[from];
+            normal[(base + x) * 2] = low.normal[from * 2];
+            normal[(base + x) * 2 + 1] = low.normal[from * 2 + 1];
+            std::copy_n(&low.albedo[from * 3], 3, &albedo[(base + x) * 3]);
+            object[base + x] = low.object[from];
+        }
+    }
+    
+    void decodeDepthRow(int y, float* out) const {
+        const uint16_t* in = &depth[(size_t)y * camera.width];
+        for (int x = 0; x < camera.width; ++x) out[x] = halfToFloat(in[x]);
+    }
+    
+    void decodeNormalRow(int y, Vec3* out) const {
+        const int16_t* in = &normal[(size_t)y * camera.width * 2];
+        for (int x = 0; x < camera.width; ++x) out[x] = decodeOctahedral(in[x * 2], in[x * 2 + 1]);
+    }
+    
+    void decodeAlbedoRow(int y, Color* out) const {
+        const uint8_t* in = &albedo[(size_t)y * camera.width * 3];
+        for (int x = 0; x < camera.width; ++x) out[x] = Color(in[x * 3], in[x * 3 + 1], in[x * 3 + 2]) * (1.0f / 255.0f);
+    }
+    
+    // World position of the primary hit at pixel (x, y); only meaningful where the depth is finite
+    Vec3 position(int x, int y) const {
+        return camera.ray((float)x, (float)y).at(halfToFloat(depth[(size_t)y * camera.width + x]));
+    }
+};
+
+// G-buffer channel shown in place of the image
+enum class GBufferView { Off, Normal, Depth, Albedo, Object };
+
+inline const char* gbufferViewName(GBufferView view) {
+    switch (view) {
+        case GBufferView::Off: return "off";
+        case GBufferView::Normal: return "normal";
+        case GBufferView::Depth: return "depth";
+        case GBufferView::Albedo: return "albedo";
+        case GBufferView::Object: return "object id";
+    }
+    return "";
+}
+
+// One immutable version of everything render workers read. The spheres and the BVH are
+// shared with the version it was copied from until an edit asks for a writable copy, so
+// versions that only move the camera or the light copy no geometry.
+struct SceneState {
+    uint64_t version = 0;
+    Vec3 camera_pos;
+    Vec3 light_pos;
+    std::vector<std::shared_ptr<Texture>> textures;   // Loaded from files; kept alive with the versions using them
+    
+    SceneState() : sphere_data(std::make_shared<std::vector<Sphere>>()), bvh_data(std::make_shared<BVH>()) {}
+    
+    SceneState(const SceneState& other)
+        : version(other.version), camera_pos(other.camera_pos), light_pos(other.light_pos), textures(other.textures),
+          sphere_data(other.sphere_data), bvh_data(other.bvh_data), owns_spheres(false), owns_bvh(false) {}
+    
+    SceneState& operator=(const SceneState&) = delete;
+    
+    const std::vector<Sphere>& spheres() const { return *sphere_data; }
+    const BVH& bvh() const { return *bvh_data; }
+    
+    // Writable parts for an edit of an unpublished version; the first call copies the part
+    std::vector<Sphere>& editSpheres() {
+        if (!owns_spheres) {
+            sphere_data = std::make_shared<std::vector<Sphere>>(*sphere_data);
+            owns_spheres = true;
+        }
+        return *sphere_data;
+    }
+    
+    BVH& editBvh() {
+        if (!owns_bvh) {
+            bvh_data = std::make_shared<BVH>(*bvh_data);
+            owns_bvh = true;
+        }
+        return *bvh_data;
+    }
+    
+    // Empty BVH for a full rebuild, without copying the one it replaces
+    BVH& replaceBvh() {
+        bvh_data = std::make_shared<BVH>();
+        owns_bvh = true;
+        return *bvh_data;
+    }
+    
+private:
+    std::shared_ptr<std::vector<Sphere>> sphere_data;
+    std::shared_ptr<BVH> bvh_data;
+    bool owns_spheres = true, owns_bvh = true;
+};
+
+// RCU-style scene store. Writers copy the latest version, change the copy and publish it
+// with a compare-and-swap, retrying if another writer got in first; readers take a
+// snapshot with one atomic load and never wait. A version is freed when the last
+// snapshot referencing it is released, which is the RCU grace period.
+class SceneStore {
+public:
+    SceneStore() : current(std::make_shared<const SceneState>()) {}
+    
+    std::shared_ptr<const SceneState> snapshot() const {
+        return std::atomic_load(&current);
+    }
+    
+    // Apply edit(SceneState&) to a copy of the latest version and publish the copy
+    template <typename Fn>
+    uint64_t update(Fn&& edit) {
+        std::shared_ptr<const SceneState> base = snapshot();
+        while (true) {
+            auto next = std::make_shared<SceneState>(*base);
+            edit(*next);
+            next->version = base->version + 1;
+            std::shared_ptr<const SceneState> published = next;
+            if (std::atomic_compare_exchange_strong(&current, &base, published)) return next->version;
+        }
+    }
+    
+private:
+    std::shared_ptr<const SceneState> current;
+};
+
+// ---- Batched geometry queries ----
+
+// Rays in structure-of-arrays layout. Directions need not be normalised; hit distances
+// are measured along the normalised direction.
+struct RayBatch {
+    std::vector<float> origin_x, origin_y, origin_z;
+    std::vector<float> direction_x, direction_y, direction_z;
+    std::vector<float> t_max;   // Hits at or beyond it are ignored
+    
+    size_t size() const { return t_max.size(); }
+    
+    void push(const Vec3& origin, const Vec3& direction, float limit = 1e30f) {
+        origin_x.push_back(origin.x);
+        origin_y.push_back(origin.y);
+        origin_z.push_back(origin.z);
+        direction_x.push_back(direction.x);
+        direction_y.push_back(direction.y);
+        direction_z.push_back(direction.z);
+        t_max.push_back(limit);
+    }
+};
+
+// Query points for nearest-surface searches
+struct PointBatch {
+    std::vector<float> x, y, z;
+    std::vector<float> max_distance;   // Search radius per point
+    
+    size_t size() const { return max_distance.size(); }
+    
+    void push(const Vec3& p, float radius = 1e30f) {
+        x.push_back(p.x);
+        y.push_back(p.y);
+        z.push_back(p.z);
+        max_distance.push_back(radius);
+    }
+};
+
+// Per-query surface records; prim is -1 (and the rest unset) where nothing was found
+struct SurfaceBatch {
+    std::vector<float> t;                              // Ray distance, or point-to-surface distance
+    std::vector<int> prim;                             // Sphere index in the queried scene
+    std::vector<float> position_x, position_y, position_z;
+    std::vector<float> normal_x, normal_y, normal_z;   // Outward unit normal
+    std::vector<float> u, v;                           // Texture coordinates, as Sphere::getUV
+    
+    void resize(size_t n) {
+        for (auto* column : {&t, &position_x, &position_y, &position_z, &normal_x, &normal_y, &normal_z, &u, &v}) {
+            column->assign(n, 0.0f);
+        }
+        prim.assign(n, -1);
+    }
+    
+    void set(size_t i, const Sphere& sphere, int index, float distance, const Vec3& position) {
+        Vec3 n = position - sphere.center;
+        n = n.dot(n) > 0.0f ? n.normalize() : Vec3(0, 1, 0);
+        t[i] = distance;
+        prim[i] = index;
+        position_x[i] = position.x;
+        position_y[i] = position.y;
+        position_z[i] = position.z;
+        normal_x[i] = n.x;
+        normal_y[i] = n.y;
+        normal_z[i] = n.z;
+        sphere.getUV(sphere.center + n, u[i], v[i]);
+    }
+};
+
+// Closest-hit, any-hit and nearest-surface queries against one scene version, for
+// clients other than the renderer (line of sight, distances). Batches are split across
+// threads and rays travel in packets of RayPacket::kSize consecutive rays, so coherent
+// rays should be adjacent. The query holds its snapshot, which cannot change under it.
+class SceneQuery {
+public:
+    explicit SceneQuery(std::shared_ptr<const SceneState> scene, int threads = 0)
+        : scene(std::move(scene)), threads(threads > 0 ? threads : std::max(1u, std::thread::hardware_concurrency())) {}
+    
+    // Standalone scene over the given spheres
+    SceneQuery(std::vector<Sphere> spheres, int threads = 0, BvhPreset preset = BvhPreset::Balanced)
+        : threads(threads > 0 ? threads : std::max(1u, std::thread::hardware_concurrency())) {
+        auto state = std::make_shared<SceneState>();
+        state->editSpheres() = std::move(spheres);
+        state->editBvh().build(state->spheres(), preset, this->threads);
+        scene = state;
+    }
+    
+    int packet_width = RayPacket::kSize;   // Rays gathered per packet, 1 to RayPacket::kSize
+    
+    const SceneState& state() const { return *scene; }
+    
+    void closestHit(const RayBatch& rays, SurfaceBatch& hits) const {
+        hits.resize(rays.size());
+        forEachPacket(rays, [&](RayPacket& packet, size_t first) {
+            int prim[RayPacket::kSize];
+            std::fill(prim, prim + RayPacket::kSize, -1);
+            scene->bvh().traversePacket(packet, [&](const BVHNode& leaf, const int* active) {
+                for (int i = leaf.first; i < leaf.first + leaf.count; ++i) {
+                    const Sphere& sphere = scene->spheres()[scene->bvh().prim_indices[i]];
+                    for (int lane = 0; lane < packet.count; ++lane) {
+                        if (!active[lane]) continue;
+                        float t = sphere.intersect(packet.origin(lane), packet.direction(lane));
+                        if (t > 0 && t < packet.t_max[lane]) {
+                            packet.t_max[lane] = t;
+                            prim[lane] = scene->bvh().prim_indices[i];
+                        }
+                    }
+                }
+                return false;
+            });
+            for (int lane = 0; lane < packet.count; ++lane) {
+                if (prim[lane] < 0) continue;
+                float t = packet.t_max[lane];
+                hits.set(first + lane, scene->spheres()[prim[lane]], prim[lane], t, packet.origin(lane) + packet.direction(lane) * t);
+            }
+        });
+    }
+    
+    // occluded[i] is 1 when anything lies along ray i before its t_max
+    void anyHit(const RayBatch& rays, std::vector<uint8_t>& occluded) const {
+        occluded.assign(rays.size(), 0);
+        forEachPacket(rays, [&](RayPacket& packet, size_t first) {
+            int remaining = packet.count;
+            scene->bvh().traversePacket(packet, [&](const BVHNode& leaf, const int* active) {
+                for (int i = leaf.first; i < leaf.first + leaf.count; ++i) {
+                    const Sphere& sphere = scene->spheres()[scene->bvh().prim_indices[i]];
+                    for (int lane = 0; lane < packet.count; ++lane) {
+                        if (!active[lane] || packet.t_max[lane] < 0) continue;
+                        float t = sphere.intersect(packet.origin(lane), packet.direction(lane));
+                        if (t > 0 && t < packet.t_max[lane]) {
+                            occluded[first + lane] = 1;
+                            packet.t_max[lane] = -1.0f;
+                            --remaining;
+                        }
+                    }
+                }
+                return remaining == 0;
+            });
+        });
+    }
+    
+    void nearestSurface(const PointBatch& points, SurfaceBatch& hits) const {
+        hits.resize(points.size());
+        ::parallelFor((int)points.size(), threads, [&](int i) {
+            Vec3 p(points.x[i], points.y[i], points.z[i]);
+            float distance = points.max_distance[i];
+            int prim = scene->bvh().nearest(scene->spheres(), p, distance);
+            if (prim < 0) return;
+            const Sphere& sphere = scene->spheres()[prim];
+            Vec3 n = p - sphere.center;
+            n = n.dot(n) > 0.0f ? n.normalize() : Vec3(0, 1, 0);
+            hits.set(i, sphere, prim, distance, sphere.center + n * sphere.radius);
+        });
+    }
+    
+private:
+    std::shared_ptr<const SceneState> scene;
+    int threads;
+    
+    // Gather consecutive rays into packets and run fn(packet, first ray index) across threads
+    template <typename Fn>
+    void forEachPacket(const RayBatch& rays, Fn&& fn) const {
+        size_t width = (size_t)std::max(1, std::min(packet_width, RayPacket::kSize));
+        int packets = (int)((rays.size() + width - 1) / width);
+        ::parallelFor(packets, threads, [&](int p) {
+            size_t first = (size_t)p * width;
+            size_t end = std::min(rays.size(), first + width);
+            RayPacket packet;
+            for (size_t i = first; i < end; ++i) {
+                packet.add(Vec3(rays.origin_x[i], rays.origin_y[i], rays.origin_z[i]),
+                           Vec3(rays.direction_x[i], rays.direction_y[i], rays.direction_z[i]), rays.t_max[i]);
+            }
+            fn(packet, first);
+        });
+    }
+};
+
+// What changed between two scene versions; consumers update only what it names
+struct ChangeSet {
+    std::vector<int> moved;      // Spheres whose centre changed
+    bool light_moved = false;
+    bool camera_moved = false;
+    
+    bool empty() const { return moved.empty() && !light_moved && !camera_moved; }
+};
+
+// Least work an edit needed to bring the acceleration structure up to date
+enum class SceneUpdate { None, MaterialPatch, Refit, Insert, Remove, Rebuild };
+
+inline const char* sceneUpdateName(SceneUpdate update) {
+    switch (update) {
+        case SceneUpdate::None: return "no change";
+        case SceneUpdate::MaterialPatch: return "material patch";
+        case SceneUpdate::Refit: return "BVH refit";
+        case SceneUpdate::Insert: return "BVH leaf insert";
+        case SceneUpdate::Remove: return "BVH leaf removal";
+        case SceneUpdate::Rebuild: return "BVH rebuild";
+    }
+    return "";
+}
+
+// Lines typed on stdin, queued by the console reader thread for the main thread. Shared
+// with the detached reader so it stays valid for as long as the reader runs.
+struct ConsoleQueue {
+    std::mutex mutex;
+    std::vector<std::string> lines;
+};
+
+enum class Interpolation { Step, Linear, CatmullRom };
+
+struct Keyframe {
+    float time;
+    Vec3 value;
+};
+
+// Position track for one sphere or the light. Keyframed when it has keys; otherwise
+// procedural: base + amplitude * sin(frequency * t + phase) per axis.
+struct AnimationTrack {
+    static constexpr int kLight = -1;
+    
+    int object = kLight;          // Sphere index, or kLight
+    std::vector<Keyframe> keys;   // Sorted by time
+    Interpolation interpolation = Interpolation::Linear;
+    bool loop = true;             // Keyframes repeat with the last key's time as period
+    Vec3 base, amplitude, frequency, phase;
+    
+    static AnimationTrack oscillate(int object, const Vec3& base, const Vec3& amplitude, const Vec3& frequency,
+                                    const Vec3& phase = Vec3(0, 0, 0)) {
+        AnimationTrack track;
+        track.object = object;
+        track.base = base;
+        track.amplitude = amplitude;
+        track.frequency = frequency;
+        track.phase = phase;
+        return track;
+    }
+    
+    Vec3 evaluate(float t) const {
+        if (keys.empty()) {
+            return base + Vec3(amplitude.x * sin(frequency.x * t + phase.x), amplitude.y * sin(frequency.y * t + phase.y),
+                               amplitude.z * sin(frequency.z * t + phase.z));
+        }
+        if (keys.size() == 1) return keys[0].value;
+        float start = keys.front().time, end = keys.back().time;
+        if (loop && end > start) t = start + std::fmod(std::fmod(t - start, end - start) + (end - start), end - start);
+        if (t <= start) return keys.front().value;
+        if (t >= end) return keys.back().value;
+        
+        size_t i = std::upper_bound(keys.begin(), keys.end(), t, [](float v, const Keyframe& k) { return v < k.time; }) - keys.begin() - 1;
+        const Keyframe& k1 = keys[i];
+        const Keyframe& k2 = keys[i + 1];
+        float u = (t - k1.time) / std::max(1e-6f, k2.time - k1.time);
+        switch (interpolation) {
+            case Interpolation::Step:
+                return k1.value;
+            case Interpolation::Linear:
+                return k1.value * (1 - u) + k2.value * u;
+            case Interpolation::CatmullRom: {
+                // Uniform Catmull-Rom; the end keys are repeated as their own neighbours
+                const Vec3& p0 = keys[i > 0 ? i - 1 : i].value;
+                const Vec3& p3 = keys[i + 2 < keys.size() ? i + 2 : i + 1].value;
+                float u2 = u * u, u3 = u2 * u;
+                return (k1.value * 2 + (k2.value - p0) * u + (p0 * 2 - k1.value * 5 + k2.value * 4 - p3) * u2 +
+                        (k1.value * 3 - p0 - k2.value * 3 + p3) * u3) * 0.5f;
+            }
+        }
+        return k1.value;
+    }
+};
+
+// Evaluates every track for a time and reports what moved. Tracks are independent, so
+// large track sets are evaluated across threads; at most one track drives each object.
+class AnimationSystem {
+public:
+    std::vector<AnimationTrack> tracks;
+    
+    // Remove the track driving an object, if any
+    void clear(int object) {
+        tracks.erase(std::remove_if(tracks.begin(), tracks.end(), [object](const AnimationTrack& track) {
+            return track.object == object;
+        }), tracks.end());
+    }
+    
+    void set(const AnimationTrack& track) {
+        clear(track.object);
+        tracks.push_back(track);
+    }
+    
+    // Hand the track driving object from over to object to; follows a swap-remove of the
+    // scene's spheres
+    void relabel(int from, int to) {
+        for (auto& track : tracks) {
+            if (track.object == from) track.object = to;
+        }
+    }
+    
+    // Add or replace a keyframe on an object's track. A procedural track is replaced by a
+    // keyframed Catmull-Rom track.
+    void addKey(int object, const Keyframe& key) {
+        auto track = std::find_if(tracks.begin(), tracks.end(), [object](const AnimationTrack& t) { return t.object == object; });
+        if (track == tracks.end() || track->keys.empty()) {
+            AnimationTrack keyed;
+            keyed.object = object;
+            keyed.interpolation = Interpolation::CatmullRom;
+            set(keyed);
+            track = tracks.end() - 1;
+        }
+        auto& keys = track->keys;
+        auto at = std::lower_bound(keys.begin(), keys.end(), key.time, [](const Keyframe& k, float t) { return k.time < t; });
+        if (at != keys.end() && at->time == key.time) *at = key;
+        else keys.insert(at, key);
+    }
+    
+    // Evaluate every track at time t and record in changes what differs from the scene
+    void evaluate(float t, const SceneState& scene, int threads, ChangeSet& changes) {
+        int count = (int)tracks.size();
+        positions.resize(count);
+        ::parallelFor(count, count >= kParallelThreshold ? threads : 1, [&](int i) {
+            positions[i] = tracks[i].evaluate(t);
+        });
+        
+        moved_positions.clear();
+        for (int i = 0; i < count; ++i) {
+            int object = tracks[i].object;
+            if (object == AnimationTrack::kLight) {
+                if (positions[i] != scene.light_pos) {
+                    changes.light_moved = true;
+                    light_pos = positions[i];
+                }
+            } else if (object < (int)scene.spheres().size() && positions[i] != scene.spheres()[object].center) {
+                changes.moved.push_back(object);
+                moved_positions.push_back(positions[i]);
+            }
+        }
+    }
+    
+    // Write the positions found by the last evaluate() into the next scene version
+    void apply(const ChangeSet& changes, SceneState& next) const {
+        if (changes.light_moved) next.light_pos = light_pos;
+        if (moved_positions.empty()) return;
+        std::vector<Sphere>& spheres = next.editSpheres();
+        for (size_t i = 0; i < moved_positions.size(); ++i) spheres[changes.moved[i]].center = moved_positions[i];
+    }
+    
+private:
+    static constexpr int kParallelThreshold = 4096;
+    std::vector<Vec3> positions;         // Per track, from the last evaluate()
+    std::vector<Vec3> moved_positions;   // Parallel to ChangeSet::moved
+    Vec3 light_pos;
+};
+
+// Command-line settings
+struct LaunchOptions {
+    int scatter_spheres = 0;   // --spheres N
+    int threads = 0;           // --threads N, 0 for one per hardware thread
+    uint32_t seed = 0;         // --seed N
+    bool benchmark = false;    // --benchmark
+    bool console = false;      // --console: scene editing commands on stdin
+    bool headless = false;     // No window or GL context; for batch rendering
+    int thumbnails = 0;        // --thumbnails N: render N orbiting views to PPM files and exit
+    int thumbnail_width = 256, thumbnail_height = 256;   // --size WxH
+    int thumbnail_samples = 16;                          // --spp N
+    bool tune = false;         // --tune: auto-tune for this host and scene, save the result and exit
+    std::string scene_path;    // --scene FILE: load and watch a scene file instead of the built-in scene
+};
+
+// Deterministic field of small diffuse spheres resting on the ground sphere
+void scatterSpheres(std::vector<Sphere>& spheres, int count) {
+    std::mt19937 rng(7);
+    std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+    for (int i = 0; i < count; ++i) {
+        float r = 0.05f + 0.15f * unit(rng);
+        float x = -20.0f + 40.0f * unit(rng);
+        float z = -25.0f + 30.0f * unit(rng);
+        float y = sqrt(std::max(0.0f, 101.0f * 101.0f - x * x - (z + 5) * (z + 5))) - 101.0f + r;
+        spheres.push_back(Sphere(Vec3(x, y, z), r, Color(0.2f + 0.8f * unit(rng), 0.2f + 0.8f * unit(rng), 0.2f + 0.8f * unit(rng)),
+                                 0.0f, 0.0f, 1.0f));
+    }
+}
+
+inline bool parseFloat(const std::string& token, float& value) {
+    char* end = nullptr;
+    value = strtof(token.c_str(), &end);
+    return !token.empty() && *end == '\0';
+}
+
+// Parse "diffuse | metal <roughness> | glass <ior> [<roughness>] | coated <ior> <roughness>"
+// starting at tokens[i] and advance i past it. Metal takes color as its reflectance.
+inline bool parseMaterial(const std::vector<std::string>& tokens, size_t& i, const Color& color, Material& material) {
+    auto number = [&](float& value) {
+        if (i >= tokens.size() || !parseFloat(tokens[i], value)) return false;
+        ++i;
+        return true;
+    };
+    if (i >= tokens.size()) return false;
+    std::string type = tokens[i++];
+    float a = 0.0f, b = 0.0f;
+    if (type == "diffuse") {
+        material = Material::lambert();
+    } else if (type == "metal" && number(a)) {
+        material = Material::conductor(color, a);
+    } else if (type == "glass" && number(a)) {
+        if (!number(b)) b = 0.0f;
+        material = Material::dielectric(a, b);
+    } else if (type == "coated" && number(a) && number(b)) {
+        material = Material::coated(a, b);
+    } else {
+        return false;
+    }
+    return true;
+}
+
+// One line of a scene file
+struct SceneFileEntry {
+    enum Kind { kSphere, kLight, kTexture };
+    Kind kind = kSphere;
+    Vec3 position;                            // Sphere centre or light position
+    float radius = 1.0f;
+    Color color;
+    Material material = Material::lambert();
+    std::string name;                         // Texture name
+    std::string path;                         // Texture file, for kTexture
+};
+
+// Line-based scene description, one object per line:
+//   sphere <x> <y> <z> <radius> <r> <g> <b> [<material>] [texture <name>]
+//   light <x> <y> <z>
+//   texture <name> <file.ppm>
+// with <material> as for parseMaterial and # starting a comment. Texture paths are
+// relative to the scene file. Each line is a chunk: a reload only parses lines whose
+// text did not appear in the previous version of the file.
+class SceneFile {
+public:
+    std::string path;
+    std::vector<SceneFileEntry> entries;   // In file order
+    int lines = 0;                         // Object lines in the file at the last load
+    int parsed_lines = 0;                  // Of which the last load had to parse
+    
+    // On failure error is set and the previous entries are kept
+    bool load(std::string& error) {
+        std::ifstream file(path);
+        if (!file) {
+            error = "cannot open " + path;
+            return false;
+        }
+        std::vector<SceneFileEntry> next;
+        std::map<std::string, SceneFileEntry> next_chunks;
+        int parsed = 0, number = 0;
+        std::string line;
+        while (std::getline(file, line)) {
+            ++number;
+            line = line.substr(0, line.find('#'));
+            line.erase(0, line.find_first_not_of(" \t\r"));
+            line.erase(line.find_last_not_of(" \t\r") + 1);
+            if (line.empty()) continue;
+            
+            auto chunk = chunks.find(line);
+            SceneFileEntry entry;
+            if (chunk != chunks.end()) {
+                entry = chunk->second;
+            } else if (parseLine(line, entry)) {
+                ++parsed;
+            } else {
+                error = path + ":" + std::to_string(number) + ": cannot parse '" + line + "'";
+                return false;
+            }
+            next_chunks[line] = entry;
+            next.push_back(entry);
+        }
+        entries.swap(next);
+        chunks.swap(next_chunks);
+        lines = (int)entries.size();
+        parsed_lines = parsed;
+        return true;
+    }
+    
+    // Texture paths are taken relative to the scene file's directory
+    std::string resolve(const std::string& file) const {
+        size_t slash = path.find_last_of('/');
+        if (file.empty() || file[0] == '/' || slash == std::string::npos) return file;
+        return path.substr(0, slash + 1) + file;
+    }
+    
+private:
+    std::map<std::string, SceneFileEntry> chunks;   // Parsed entries by line text, from the last load
+    
+    bool parseLine(const std::string& line, SceneFileEntry& entry) const {
+        std::istringstream in(line);
+        std::vector<std::string> tokens;
+        for (std::string token; in >> token;) tokens.push_back(token);
+        size_t i = 1;
+        auto number = [&](float& value) {
+            if (i >= tokens.size() || !parseFloat(tokens[i], value)) return false;
+            ++i;
+            return true;
+        };
+        Vec3& p = entry.position;
+        Color& c = entry.color;
+        
+        if (tokens[0] == "sphere") {
+            entry.kind = SceneFileEntry::kSphere;
+            if (!number(p.x) || !number(p.y) || !number(p.z) || !number(entry.radius) || entry.radius <= 0.0f ||
+                !number(c.r) || !number(c.g) || !number(c.b)) return false;
+            if (i < tokens.size() && tokens[i] != "texture" && !parseMaterial(tokens, i, c, entry.material)) return false;
+            if (i + 1 < tokens.size() && tokens[i] == "texture") {
+                entry.name = tokens[i + 1];
+                i += 2;
+            }
+        } else if (tokens[0] == "light") {
+            entry.kind = SceneFileEntry::kLight;
+            if (!number(p.x) || !number(p.y) || !number(p.z)) return false;
+        } else if (tokens[0] == "texture" && tokens.size() == 3) {
+            entry.kind = SceneFileEntry::kTexture;
+            entry.name = tokens[1];
+            entry.path = resolve(tokens[2]);
+            i = 3;
+        } else {
+            return false;
+        }
+        return i == tokens.size();
+    }
+};
+
+// Reports watched files that were written. On Linux inotify watches each file's
+// directory, which also catches editors that save by renaming a new file over the old
+// one; elsewhere modification times are polled.
+class FileWatcher {
+public:
+    FileWatcher() {
+#ifdef __linux__
+        fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+#endif
+    }
+    
+    ~FileWatcher() {
+#ifdef __linux__
+        if (fd >= 0) close(fd);
+#endif
+    }
+    
+    FileWatcher(const FileWatcher&) = delete;
+    FileWatcher& operator=(const FileWatcher&) = delete;
+    
+    void watch(const std::string& path) {
+        for (const auto& file : files) if (file.path == path) return;
+        WatchedFile file;
+        file.path = path;
+        size_t slash = path.find_last_of('/');
+        file.directory = slash == std::string::npos ? "." : path.substr(0, std::max<size_t>(slash, 1));
+        file.name = slash == std::string::npos ? path : path.substr(slash + 1);
+        file.modified = modificationTime(path);
+#ifdef __linux__
+        if (fd >= 0 && !directories.count(file.directory)) {
+            int wd = inotify_add_watch(fd, file.directory.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO);
+            if (wd >= 0) directories[file.directory] = wd;
+        }
+#endif
+        files.push_back(file);
+    }
+    
+    // Watched files written since the last call, each reported once
+    std::vector<std::string> changed() {
+        std::vector<std::string> result;
+        auto report = [&result](const std::string& path) {
+            if (std::find(result.begin(), result.end(), path) == result.end()) result.push_back(path);
+        };
+#ifdef __linux__
+        if (fd >= 0) {
+            alignas(inotify_event) char buffer[4096];
+            ssize_t length;
+            while ((length = read(fd, buffer, sizeof(buffer))) > 0) {
+                for (char* p = buffer; p < buffer + length;) {
+                    const inotify_event* event = reinterpret_cast<const inotify_event*>(p);
+                    p += sizeof(inotify_event) + event->len;
+                    if (event->len == 0) continue;
+                    for (const auto& file : files) {
+                        auto directory = directories.find(file.directory);
+                        if (directory != directories.end() && directory->second == event->wd && file.name == event->name) report(file.path);
+                    }
+                }
+            }
+            return result;
+        }
+#endif
+        for (auto& file : files) {
+            long long modified = modificationTime(file.path);
+            if (modified != file.modified) {
+                file.modified = modified;
+                report(file.path);
+            }
+        }
+        return result;
+    }
+    
+private:
+    struct WatchedFile {
+        std::string path, directory, name;
+        long long modified;   // Polled modification time, without inotify
+    };
+    std::vector<WatchedFile> files;
+    int fd = -1;
+    std::map<std::string, int> directories;   // inotify watch descriptor per directory
+    
+    static long long modificationTime(const std::string& path) {
+        struct stat info;
+        return stat(path.c_str(), &info) == 0 ? (long long)info.st_mtime : -1;
+    }
+};
+
+// Presentation-side reprojection ("timewarp"). A finished frame is forward-splatted to a
+// newer camera through the depth in its G-buffer, the nearest surface winning each pixel.
+// Holes opened by disocclusion and stretching are then filled from their farthest valid
+// neighbour, which is the background a moving edge uncovers. Both steps split rows across
+// the reprojector's own workers: splats may land in any row, so each worker keeps the
+// nearest splat for a band of target rows, and the fill passes only visit the holes.
+struct Reprojector {
+    static constexpr float kSkyDepth = 1e4f;   // Stand-in distance for rays that hit nothing
+    static constexpr int kFillPasses = 4;      // Holes wider than this take the unwarped pixel
+    static constexpr uint64_t kEmpty = UINT64_MAX;   // Splat key of a pixel nothing landed on
+    
+    int threads = 1;   // Presenter workers, kept apart from the tracer's
+    
+    // 1/sqrt(l) for l > 0: the exponent-halving initial guess and two Newton steps reach a
+    // relative error of 5e-6, well inside the half-float depth, in straight-line code where
+    // sqrt would block vectorisation
+    static float inverseSqrt(float l) {
+        uint32_t bits;
+        std::memcpy(&bits, &l, sizeof(bits));
+        bits = 0x5F3759DF - (bits >> 1);
+        float inv;
+        std::memcpy(&inv, &bits, sizeof(inv));
+        for (int step = 0; step < 2; ++step) inv *= 1.5f - 0.5f * l * inv * inv;
+        return inv;
+    }
+    
+    // Where the source frame's pixels land in the target view. A source ray is
+    // right * u - up * v + forward in the source basis (Camera::ray), so its point at distance
+    // t is known in the target basis from nine dot products taken once per warp.
+    struct Projection {
+        int width, height;
+        float aspect;
+        Vec3 base, du, dv, df;   // Source position and basis in target coordinates
+        
+        Projection(const Camera& from, const Camera& to)
+            : width(from.width), height(from.height), aspect((float)from.height / from.width) {
+            Vec3 offset = from.position - to.position;
+            base = Vec3(offset.dot(to.right), offset.dot(to.up), offset.dot(to.forward));
+            du = Vec3(from.right.dot(to.right), from.right.dot(to.up), from.right.dot(to.forward));
+            dv = Vec3(from.up.dot(to.right), from.up.dot(to.up), from.up.dot(to.forward));
+            df = Vec3(from.forward.dot(to.right), from.forward.dot(to.up), from.forward.dot(to.forward));
+        }
+        
+        // View depth and target pixel index (-1 when off screen or behind the camera) of every
+        // pixel of source row y, in a branch-free loop g++ -O3 vectorises. Everything that
+        // only depends on the row is folded into constants first: the loop runs for every
+        // pixel at every vsync the camera moves.
+        void row(int y, const float* distance, float* view_z, int* target) const {
+            int w = width, h = height;
+            float u_scale = 2.0f / w;
+            float v = ((float)y / h * 2.0f - 1.0f) * aspect;
+            float v2 = v * v + 1.0f;
+            Vec3 ru = du, c = df - dv * v, b = base;
+            // Inverse of Camera::ray; pixel x covers [x - 0.5, x + 0.5)
+            float scale_x = 0.5f * w, scale_y = -0.5f * h / aspect;
+            float offset_x = 0.5f * w + 0.5f, offset_y = 0.5f * h + 0.5f;
+            for (int x = 0; x < w; ++x) {
+                float u = x * u_scale - 1.0f;
+                float s = std::min(distance[x], kSkyDepth) * inverseSqrt(u * u + v2);
+                float qx = b.x + (ru.x * u + c.x) * s;
+                float qy = b.y + (ru.y * u + c.y) * s;
+                float qz = b.z + (ru.z * u + c.z) * s;
+                float inv_z = 1.0f / qz;
+                float raster_x = qx * inv_z * scale_x + offset_x;
+                float raster_y = qy * inv_z * scale_y + offset_y;
+                // Clamping before the conversion keeps NaN and huge positions out of the int range
+                int tx = (int)std::min((float)w, std::max(-1.0f, raster_x));
+                int ty = (int)std::min((float)h, std::max(-1.0f, raster_y));
+                bool inside = (qz > 1e-4f) & (raster_x >= 0.0f) & (tx < w) & (raster_y >= 0.0f) & (ty < h);
+                view_z[x] = qz;
+                target[x] = inside ? ty * w + tx : -1;
+            }
+        }
+    };
+    
+    AlignedVector<unsigned char, MemoryTag::Frame> color;   // Output, RGB, top row first
+    AlignedVector<float, MemoryTag::Frame> depth;           // View depth of each output pixel, -1 for holes
+    
+    void warp(const AlignedVector<unsigned char, MemoryTag::Frame>& src_color, const GBuffer& src, const Camera& to) {
+        const Camera& from = src.camera;
+        int w = from.width, h = from.height;
+        size_t pixels = (size_t)w * h;
+        color.resize(src_color.size());
+        depth.resize(pixels);
+        spare.resize(pixels);
+        holes.resize(h);
+        target.resize(pixels);
+        row_span.resize(h);
+        if (nearest.size() != pixels) nearest.assign(pixels, kEmpty);
+        
+        // Project every source pixel, keeping its view depth in spare until the resolve and
+        // noting the span of target pixels each source row reaches
+        Projection projection(from, to);
+        ::parallelFor(h, threads, [&](int y) {
+            std::vector<float> src_depth(w);
+            src.decodeDepthRow(y, src_depth.data());
+            int* row = &target[(size_t)y * w];
+            projection.row(y, src_depth.data(), &spare[(size_t)y * w], row);
+            unsigned low = UINT_MAX;   // -1 converts to UINT_MAX, which leaves the minimum alone
+            int high = -1;
+            for (int x = 0; x < w; ++x) {
+                low = std::min(low, (unsigned)row[x]);
+                high = std::max(high, row[x]);
+            }
+            row_span[y] = {(int)std::min(low, (unsigned)INT_MAX), high};
+        });
+        
+        // Splat: each worker keeps the nearest splat of its own band of target rows, so no
+        // pixel is written by two workers, visiting only the source rows that reach the band.
+        // The key orders by view depth (positive floats order like their bits), then by
+        // source index, so the result matches a serial scan keeping the first nearest pixel.
+        ::parallelFor(threads, threads, [&](int worker) {
+            int first = (int)((size_t)h * worker / threads * w);
+            int last = (int)((size_t)h * (worker + 1) / threads * w);
+            for (int y = 0; y < h; ++y) {
+                if (row_span[y].second < first || row_span[y].first >= last) continue;
+                for (int x = 0; x < w; ++x) {
+                    size_t i = (size_t)y * w + x;
+                    int t = target[i];
+                    if (t < first || t >= last) continue;
+                    uint32_t z_bits;
+                    std::memcpy(&z_bits, &spare[i], sizeof(z_bits));
+                    uint64_t key = (uint64_t)z_bits << 32 | (uint32_t)i;
+                    nearest[t] = std::min(nearest[t], key);
+                }
+            }
+        });
+        
+        // Resolve the winners into both depth planes, list each row's holes and leave the
+        // keys empty for the next warp
+        ::parallelFor(h, threads, [&](int y) {
+            holes[y].clear();
+            for (int x = 0; x < w; ++x) {
+                size_t t = (size_t)y * w + x;
+                uint64_t key = nearest[t];
+                if (key == kEmpty) {
+                    depth[t] = -1.0f;
+                    holes[y].push_back(x);
+                    continue;
+                }
+                nearest[t] = kEmpty;
+                uint32_t z_bits = (uint32_t)(key >> 32);
+                std::memcpy(&depth[t], &z_bits, sizeof(z_bits));
+                std::memcpy(&color[t * 3], &src_color[(key & 0xFFFFFFFF) * 3], 3);
+            }
+            std::copy_n(&depth[(size_t)y * w], w, &spare[(size_t)y * w]);
+        });
+        
+        // Each pass fills holes bordering pixels that were valid after the previous pass,
+        // reading one depth plane and writing the other. A row's list keeps the pixels that
+        // were holes when the previous pass started: those filled by it are copied across so
+        // the planes agree everywhere else, and the rest are filled or stay listed.
+        for (int pass = 0; pass < kFillPasses; ++pass) {
+            const float* previous = depth.data();
+            float* next = spare.data();
+            std::atomic<bool> open(false);
+            ::parallelFor(h, threads, [&](int y) {
+                std::vector<int>& row = holes[y];
+                size_t kept = 0;
+                for (int x : row) {
+                    size_t i = (size_t)y * w + x;
+                    if (previous[i] >= 0.0f) {
+                        next[i] = previous[i];
+                        continue;
+                    }
+                    row[kept++] = x;
+                    int best = -1;
+                    for (int dy = -1; dy <= 1; ++dy) {
+                        for (int dx = -1; dx <= 1; ++dx) {
+                            int nx = x + dx, ny = y + dy;
+                            if (nx < 0 || ny < 0 || nx >= w || ny >= h) continue;
+                            int n = ny * w + nx;
+                            if (previous[n] >= 0.0f && (best < 0 || previous[n] > previous[best])) best = n;
+                        }
+                    }
+                    if (best < 0) {
+                        open.store(true, std::memory_order_relaxed);
+                        continue;
+                    }
+                    next[i] = previous[best];
+                    std::memcpy(&color[i * 3], &color[(size_t)best * 3], 3);
+                }
+                row.resize(kept);
+            });
+            depth.swap(spare);
+            if (!open.load()) return;
+        }
+        ::parallelFor(h, threads, [&](int y) {
+            for (int x : holes[y]) {
+                size_t i = (size_t)y * w + x;
+                if (depth[i] < 0.0f) std::memcpy(&color[i * 3], &src_color[i * 3], 3);
+            }
+        });
+    }
+    
+private:
+    AlignedVector<float, MemoryTag::Frame> spare;       // Source view depths, then the fill passes' other plane
+    AlignedVector<int, MemoryTag::Frame> target;        // Target pixel of each source pixel, -1 for none
+    AlignedVector<uint64_t, MemoryTag::Frame> nearest;  // Depth bits << 32 | source pixel
+    std::vector<std::pair<int, int>> row_span;          // Lowest and highest target of each source row
+    std::vector<std::vector<int>> holes;                // Per row
+};
+
+// Binary PPM (P6) with top row first
+inline bool writePPM(const std::string& path, int width, int height, const std::vector<unsigned char>& rgb) {
+    std::ofstream file(path, std::ios::binary);
+    file << "P6\n" << width << " " << height << "\n255\n";
+    file.write(reinterpret_cast<const char*>(rgb.data()), rgb.size());
+    return bool(file);
+}
+
+// Machine- and scene-dependent settings found by the auto-tuner
+struct TuningConfig {
+    int tile_size = 32;                          // TileScheduler::base_size
+    int threads = 0;                             // Render workers, 0 for one per hardware thread
+    PixelOrder order = PixelOrder::Hilbert;
+    BvhTraversal traversal = BvhTraversal::Stack;
+    int packet_width = RayPacket::kSize;         // SceneQuery packets
+};
+
+// Tuning results keyed by host and scene class, one line each:
+//   <host> <class> tile=<n> threads=<n> order=<n> traversal=<n> packet=<n>
+// with the enums stored as their values. Hosts are named with their hardware thread count,
+// so one shared file can serve several CPU generations.
+class TuningFile {
+public:
+    std::string path = "raytracer.tune";
+    
+    static std::string hostName() {
+        char name[256] = "";
+#ifdef __linux__
+        gethostname(name, sizeof(name) - 1);
+#endif
+        return std::string(name[0] ? name : "host") + "-" + std::to_string(std::thread::hardware_concurrency()) + "t";
+    }
+    
+    // Scenes are classed by the order of magnitude of their sphere count
+    static std::string sceneClass(size_t spheres) {
+        return "spheres-1e" + std::to_string((int)std::ceil(std::log10((double)std::max<size_t>(spheres, 2))));
+    }
+    
+    bool load(const std::string& host, const std::string& scene_class, TuningConfig& config) const {
+        std::ifstream file(path);
+        std::string line;
+        while (std::getline(file, line)) {
+            std::istringstream in(line);
+            std::string line_host, line_class, field;
+            if (!(in >> line_host >> line_class) || line_host != host || line_class != scene_class) continue;
+            while (in >> field) {
+                size_t eq = field.find('=');
+                if (eq == std::string::npos) continue;
+                std::string key = field.substr(0, eq);
+                int value = atoi(field.c_str() + eq + 1);
+                if (key == "tile") config.tile_size = std::max(8, value);
+                else if (key == "threads") config.threads = std::max(0, value);
+                else if (key == "order") config.order = (PixelOrder)std::min(std::max(value, 0), 2);
+                else if (key == "traversal") config.traversal = (BvhTraversal)std::min(std::max(value, 0), 2);
+                else if (key == "packet") config.packet_width = std::min(std::max(value, 1), RayPacket::kSize);
+            }
+            return true;
+        }
+        return false;
+    }
+    
+    // Replace the host and class line, keeping every other line
+    bool save(const std::string& host, const std::string& scene_class, const TuningConfig& config) const {
+        std::vector<std::string> lines;
+        {
+            std::ifstream file(path);
+            std::string line;
+            while (std::getline(file, line)) {
+                std::istringstream in(line);
+                std::string line_host, line_class;
+                if (in >> line_host >> line_class && line_host == host && line_class == scene_class) continue;
+                lines.push_back(line);
+            }
+        }
+        std::ostringstream entry;
+        entry << host << " " << scene_class << " tile=" << config.tile_size << " threads=" << config.threads
+              << " order=" << (int)config.order << " traversal=" << (int)config.traversal << " packet=" << config.packet_width;
+        lines.push_back(entry.str());
+        
+        std::ofstream file(path);
+        for (const std::string& line : lines) file << line << "\n";
+        return bool(file);
+    }
+};
+
+class RealTimeRayTracer {
+private:
+    GLFWwindow* window;
+    AlignedVector<unsigned char, MemoryTag::Frame> frameBuffer;   // RGB rows of frame_row_length pixels
+    int width, height;
+    int frame_row_length;   // width rounded up to 64 pixels, so every row starts on a cache line
+    
+    // Camera parameters. The orbit angles and distance are written by the input callbacks
+    // and read under camera_mutex, since the tracer thread reads them too (see timewarp).
+    Vec3 camera_pos;
+    Vec3 camera_target;
+    float camera_angle_x, camera_angle_y;
+    float camera_distance;
+    std::mutex camera_mutex;
+    
+    // Animation
+    float time;
+    bool animation_paused;
+    AnimationSystem animation;
+    
+    // Render workers; pixels go through the tile scheduler, or one contiguous band of rows per thread
+    int thread_count;
+    bool tile_scheduling;
+    TileScheduler tile_scheduler;
+    TileScheduler batch_scheduler;   // Tiles of renderViews() canvases, with their own cost history
+    TileScheduler reuse_scheduler;   // Second pass of shared multi-view canvases, which mostly reuses shading
+    
+    // Textures
+    std::unique_ptr<Texture> checkerboard_texture;
+    
+    // Anti-aliasing samples per pixel
+    int samples_per_pixel;
+    
+    // Motion-adaptive quality. quality is the tier of the frame in flight; outside interactive
+    // frames (thumbnails) it stays at the top tier.
+    QualityGovernor governor;
+    QualityTier quality;
+    
+    // trace() follows one Fresnel-selected branch at dielectrics instead of both
+    bool stochastic_dielectric;
+    
+    // Active engine; Whitted is the recursive trace() preview
+    RenderEngine engine;
+    
+    // Bidirectional path tracing
+    int bdpt_max_depth;              // Maximum number of bounces of a full path
+    Color light_intensity;           // Radiant intensity of the point light
+    AlignedVector<std::atomic<int64_t>, MemoryTag::Frame> accumulation; // Per-pixel fixed-point RGB, written by camera paths and light splats
+    size_t accumulation_size;
+    uint32_t frame_index;            // Frame and seed complete the key of every random number
+    uint32_t seed;
+    
+    // Progressive accumulation: the physically based engines keep adding frames to
+    // accumulation for as long as the image they converge to stays the same
+    uint64_t accumulated_version;    // Scene version the accumulated frames show
+    RenderEngine accumulated_engine;
+    int accumulated_samples;         // samples_per_pixel of the accumulated frames
+    int accumulated_frames;          // 0 forces a restart
+    float accumulated_brightness;    // Sum of the per-frame Metropolis brightness estimates
+    
+    // Metropolis light transport
+    int mlt_bootstrap_samples;       // Bootstrap paths per path depth
+    int mlt_chains;                  // Independent Markov chains per frame
+    
+    // Level of detail: spheres covering fewer pixels than the thresholds get cheaper shading
+    bool lod_enabled;
+    float lod_full_pixels;      // Projected radius (pixels) needed for full shading
+    float lod_diffuse_pixels;   // Below this radius the flat diffuse impostor is used
+    float lod_secondary_scale;  // Each bounce shrinks the effective projected size by this factor
+    float diffuse_cone_angle;   // Spread angle given to ray cones after a diffuse (GI) bounce
+    
+    // Path-space filtering of first-hit GI. Under a cache budget the grid is smaller and
+    // samples that find no free cell go unpooled, so GI gets noisier instead of memory growing.
+    struct FilteredPixel {
+        static constexpr int kCells = 4;   // Filter cells kept per pixel; samples landing in others are shaded unpooled
+        
+        Color base;              // Sample average without the pooled GI terms
+        int cells = 0;
+        int slot[kCells];        // Filter cell of each pooled term
+        Color weight[kCells];    // Average albedo weight of the samples pooled into slot[i]
+        
+        // Index of the term for this filter cell, added if there is room; -1 when full
+        int term(int cell_slot) {
+            for (int i = 0; i < cells; ++i) {
+                if (slot[i] == cell_slot) return i;
+            }
+            if (cells == kCells) return -1;
+            slot[cells] = cell_slot;
+            weight[cells] = Color();
+            return cells++;
+        }
+    };
+    bool path_filter_enabled;
+    float path_filter_radius;   // Cell size in pixel footprints
+    PathSpaceFilter path_filter;
+    AlignedVector<FilteredPixel, MemoryTag::Frame> filtered_pixels;
+    
+    // Stereo and multi-view frames; hit_cache is filled from the const trace()
+    StereoLayout stereo;
+    float eye_separation;                      // World units between the eye positions
+    AlignedVector<unsigned char, MemoryTag::Frame> stereo_layers;  // Layered output: left then right eye, RGB
+    mutable HitPointCache hit_cache;
+    
+    // Scene versions: the main thread publishes one per frame (and per edit), render
+    // workers only read the snapshot pinned by the frame in flight
+    SceneStore scene_store;
+    std::shared_ptr<const SceneState> scene;
+    
+    // Acceleration structure settings; the BVH itself is rebuilt into every scene version
+    BvhPreset bvh_preset;
+    BvhTraversal bvh_traversal;
+    BVH::BuildStats bvh_stats;   // Of the last full build; refits are measured against its SAH cost
+    int scatter_spheres;        // Extra small spheres strewn over the ground for large-scene testing
+    
+    // Scene editing commands read from stdin; null when the console is off
+    std::shared_ptr<ConsoleQueue> console;
+    
+    // Watched scene file. file_spheres maps its sphere lines, in order, to sphere indices
+    // (-1 once removed from the console); file_textures holds its textures by name.
+    struct FileTexture {
+        std::string path;
+        std::shared_ptr<Texture> texture;
+    };
+    SceneFile scene_file;
+    FileWatcher file_watcher;
+    std::vector<int> file_spheres;
+    std::map<std::string, FileTexture> file_textures;
+    
+    // Asynchronous presentation. With timewarp on, a tracer thread renders frames while the
+    // main thread polls input and reprojects the latest finished frame to the current
+    // camera at every vsync. Input other than camera motion is queued for the tracer,
+    // which applies it between frames.
+    struct FinishedFrame {
+        AlignedVector<unsigned char, MemoryTag::Frame> color;
+        GBuffer gbuffer;   // Primary hits; empty if the frame cannot be warped
+        Camera camera;
+        bool fresh = false;
+    };
+    bool timewarp;
+    std::thread tracer;
+    std::atomic<bool> tracing;
+    std::mutex input_mutex;
+    std::vector<std::function<void()>> pending_input;
+    std::mutex present_mutex;
+    FinishedFrame finished;    // Handed over under present_mutex
+    FinishedFrame presented;   // Main thread only
+    Reprojector reprojector;
+    bool warp_current;   // reprojector.color is the presented frame warped to warped_to
+    Vec3 warped_to;
+    int traced_frames;
+    
+    // Primary hits of the last traced frame, for timewarp and the G-buffer view, recorded
+    // by the render pass while capture_gbuffer is set
+    GBuffer gbuffer;
+    GBufferView gbuffer_view;
+    bool capture_gbuffer;
+    
+    // Auto-tuned settings for this host and scene class
+    TuningFile tuning_file;
+    TuningConfig tuning;
+    bool threads_fixed;   // --threads given; the tuner leaves the worker count alone
+    
+public:
+    RealTimeRayTracer(int w, int h, const LaunchOptions& options = LaunchOptions()) : width(w), height(h), 
+        camera_pos(0, 0, 5), camera_target(0, 0, 0), 
+        camera_angle_x(0), camera_angle_y(0), camera_distance(5), time(0), animation_paused(false),
+        thread_count(options.threads > 0 ? options.threads : std::max(1u, std::thread::hardware_concurrency())), tile_scheduling(true), samples_per_pixel(2),
+        stochastic_dielectric(true),
+        engine(RenderEngine::Whitted), bdpt_max_depth(5), light_intensity(40.0f, 40.0f, 40.0f), accumulation_size(0),
+        frame_index(0), seed(options.seed), accumulated_version(0), accumulated_engine(RenderEngine::Whitted),
+        accumulated_samples(0), accumulated_frames(0), accumulated_brightness(0.0f), mlt_bootstrap_samples(20000), mlt_chains(256),
+        lod_enabled(true), lod_full_pixels(24.0f), lod_diffuse_pixels(3.0f), lod_secondary_scale(2.0f),
+        diffuse_cone_angle(0.35f), path_filter_enabled(true), path_filter_radius(6.0f),
+        path_filter(fitTableLog2(sizeof(PathSpaceFilter::Cell), memoryStats().limit(MemoryTag::Cache) * 2 / 3, 19)),
+        stereo(StereoLayout::Off), eye_separation(0.3f),
+        hit_cache(fitTableLog2(sizeof(HitPointCache::Cell), memoryStats().limit(MemoryTag::Cache) / 3, 18)),
+        bvh_preset(BvhPreset::Balanced), bvh_traversal(BvhTraversal::Stack),
+        scatter_spheres(options.scatter_spheres), timewarp(false), tracing(false), warp_current(false), traced_frames(0),
+        gbuffer_view(GBufferView::Off), capture_gbuffer(false), threads_fixed(options.threads > 0) {
+        
+        window = nullptr;
+        quality = governor.tiers.back();
+        if (!options.headless) createWindow();
+        resizeFrameBuffer();
+        
+        // Create textures
+        checkerboard_texture = std::make_unique<Texture>(64, 64);
+        
+        // Create scene
+        scene_file.path = options.scene_path;
+        createScene();
+        loadTuning();
+        
+        if (options.console) startConsole();
+    }
+    
+    void createWindow() {
+        // Initialize GLFW
+        if (!glfwInit()) {
+            std::cerr << "Failed to initialize GLFW" << std::endl;
+            exit(-1);
+        }
+        
+        // Create window
+        window = glfwCreateWindow(width, height, "Real-Time Ray Tracer", nullptr, nullptr);
+        if (!window) {
+            glfwTerminate();
+            exit(-1);
+        }
+        
+        glfwMakeContextCurrent(window);
+        glfwSetWindowUserPointer(window, this);
+        
+        // Get actual framebuffer size (important for Retina displays)
+        int fb_width, fb_height;
+        glfwGetFramebufferSize(window, &fb_width, &fb_height);
+        width = fb_width;
+        height = fb_height;
+        
+        // Set callbacks
+        glfwSetKeyCallback(window, keyCallback);
+        glfwSetCursorPosCallback(window, mouseCallback);
+        glfwSetScrollCallback(window, scrollCallback);
+        glfwSetFramebufferSizeCallback(window, framebufferSizeCallback);
+        
+        // Initialize OpenGL
+        if (glewInit() != GLEW_OK) {
+            std::cerr << "Failed to initialize GLEW" << std::endl;
+            exit(-1);
+        }
+        
+        glViewport(0, 0, width, height);
+        glDisable(GL_DEPTH_TEST);
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 1);   // Rows are laid out by GL_UNPACK_ROW_LENGTH alone
+    }
+    
+    void createScene() {
+        std::vector<Sphere> spheres;
+        
+        // The circling light stays unless a scene file places it
+        animation.tracks.clear();
+        animation.set(AnimationTrack::oscillate(AnimationTrack::kLight, Vec3(0, 2, -3), Vec3(3, 0, 3), Vec3(1, 0, 1),
+                                                Vec3(0, 0, (float)M_PI / 2)));
+        
+        // A scene file's spheres come after the scattered ones and are added by the first reload
+        if (!scene_file.path.empty()) {
+            scatterSpheres(spheres, scatter_spheres);
+            scene_store.update([&](SceneState& next) {
+                next.editSpheres() = std::move(spheres);
+                rebuildBvh(next);
+            });
+            file_watcher.watch(scene_file.path);
+            reloadSceneFile();
+            scene = scene_store.snapshot();
+            return;
+        }
+        
+        // Add spheres with different materials and textures
+        spheres.push_back(Sphere(Vec3(-2, 0, -5), 1.0f, Color(0.8f, 0.2f, 0.2f), 0.9f, 0.0f, 1.0f)); // Red metallic
+        spheres.push_back(Sphere(Vec3(0, 0, -5), 1.0f, Color(0.9f, 0.9f, 0.9f), 0.0f, 0.9f, 1.52f));   // Glass
+        spheres.push_back(Sphere(Vec3(2, 0, -5), 1.0f, Color(0.2f, 0.2f, 0.8f), 0.0f, 0.0f, 1.0f));    // Blue diffuse
+        spheres.push_back(Sphere(Vec3(0, -101, -5), 100.0f, Color(1.0f, 1.0f, 1.0f), 0.0f, 0.0f, 1.0f, checkerboard_texture.get())); // Textured ground
+        
+        // The physically based engines see the blue sphere as glossy coated plastic
+        spheres[2].material = Material::coated(1.5f, 0.15f);
+        
+        scatterSpheres(spheres, scatter_spheres);
+        
+        // The three feature spheres bob along one axis each
+        animation.set(AnimationTrack::oscillate(0, Vec3(-2, 0, -5), Vec3(0, 0.5f, 0), Vec3(0, 2, 0)));
+        animation.set(AnimationTrack::oscillate(1, Vec3(0, 0, -5), Vec3(0.5f, 0, 0), Vec3(1, 0, 0)));
+        animation.set(AnimationTrack::oscillate(2, Vec3(2, 0, -5), Vec3(0, 0, 0.3f), Vec3(0, 0, 1.5f)));
+        
+        scene_store.update([&](SceneState& next) {
+            next.editSpheres() = std::move(spheres);
+            rebuildBvh(next);
+        });
+        scene = scene_store.snapshot();
+    }
+    
+    void rebuildBvh(SceneState& next) {
+        BVH& bvh = next.replaceBvh();
+        bvh_stats = bvh.build(next.spheres(), bvh_preset, renderThreads());
+        bvh.traversal = bvh_traversal;
+    }
+    
+    // Refit the BVH around moved spheres
+    SceneUpdate updateBvh(SceneState& next, const std::vector<int>& moved) {
+        if (moved.empty()) return SceneUpdate::None;
+        next.editBvh().refit(next.spheres(), moved);
+        return keepBvhQuality(next, SceneUpdate::Refit);
+    }
+    
+    // Rebuild once incremental updates have cost too much traversal quality, or have
+    // unlinked most of the node array
+    SceneUpdate keepBvhQuality(SceneState& next, SceneUpdate update) {
+        if (next.bvh().sahCost() <= bvh_stats.sah_cost * 1.25f && !next.bvh().fragmented()) return update;
+        rebuildBvh(next);
+        return SceneUpdate::Rebuild;
+    }
+    
+    // ---- Runtime scene editing ----
+    //
+    // Each edit publishes one scene version and does the least work it needs: material
+    // and colour changes patch the sphere and leave the BVH alone, moves refit, additions
+    // and removals splice a single leaf. Progressive accumulation restarts from the new
+    // version. Edits run on the main thread, between frames.
+    
+    // Geometry queries against the latest scene version, on the render workers' thread count
+    SceneQuery query() const {
+        SceneQuery result(scene_store.snapshot(), thread_count);
+        result.packet_width = tuning.packet_width;
+        return result;
+    }
+    
+    int sphereCount() const {
+        return (int)scene_store.snapshot()->spheres().size();
+    }
+    
+    // Append a sphere; id receives its index
+    SceneUpdate addSphere(const Sphere& sphere, int& id) {
+        SceneUpdate update = SceneUpdate::None;
+        scene_store.update([&](SceneState& next) {
+            std::vector<Sphere>& spheres = next.editSpheres();
+            id = (int)spheres.size();
+            spheres.push_back(sphere);
+            if (next.editBvh().insert(spheres, id)) {
+                update = keepBvhQuality(next, SceneUpdate::Insert);
+            } else {
+                rebuildBvh(next);
+                update = SceneUpdate::Rebuild;
+            }
+        });
+        return update;
+    }
+    
+    // Remove a sphere. The last sphere takes over its index, and its animation track with it.
+    SceneUpdate removeSphere(int id) {
+        if (id < 0 || id >= sphereCount()) return SceneUpdate::None;
+        SceneUpdate update = SceneUpdate::None;
+        int last = 0;
+        scene_store.update([&](SceneState& next) {
+            std::vector<Sphere>& spheres = next.editSpheres();
+            last = (int)spheres.size() - 1;
+            spheres[id] = spheres[last];
+            spheres.pop_back();
+            next.editBvh().remove(spheres, id, last);
+            update = keepBvhQuality(next, SceneUpdate::Remove);
+        });
+        animation.clear(id);
+        animation.relabel(last, id);
+        for (int& file_id : file_spheres) {
+            if (file_id == id) file_id = -1;
+            else if (file_id == last) file_id = id;
+        }
+        return update;
+    }
+    
+    // Place a sphere, stopping any animation track that drives it
+    SceneUpdate moveSphere(int id, const Vec3& center) {
+        if (id < 0 || id >= sphereCount()) return SceneUpdate::None;
+        animation.clear(id);
+        SceneUpdate update = SceneUpdate::None;
+        scene_store.update([&](SceneState& next) {
+            next.editSpheres()[id].center = center;
+            update = updateBvh(next, std::vector<int>(1, id));
+        });
+        return update;
+    }
+    
+    SceneUpdate moveLight(const Vec3& position) {
+        animation.clear(AnimationTrack::kLight);
+        scene_store.update([&](SceneState& next) { next.light_pos = position; });
+        return SceneUpdate::None;
+    }
+    
+    SceneUpdate setMaterial(int id, const Material& material) {
+        if (id < 0 || id >= sphereCount()) return SceneUpdate::None;
+        scene_store.update([&](SceneState& next) { next.editSpheres()[id].setMaterial(material); });
+        return SceneUpdate::MaterialPatch;
+    }
+    
+    SceneUpdate setColor(int id, const Color& color) {
+        if (id < 0 || id >= sphereCount()) return SceneUpdate::None;
+        scene_store.update([&](SceneState& next) { next.editSpheres()[id].setColor(color); });
+        return SceneUpdate::MaterialPatch;
+    }
+    
+    // ---- Console front end ----
+    
+    // Read stdin on a detached thread. Lines are queued and run by the main thread between
+    // frames, where the animation system and BVH settings live.
+    void startConsole() {
+        console = std::make_shared<ConsoleQueue>();
+        std::shared_ptr<ConsoleQueue> queue = console;
+        std::thread([queue] {
+            std::string line;
+            while (std::getline(std::cin, line)) {
+                std::lock_guard<std::mutex> lock(queue->mutex);
+                queue->lines.push_back(line);
+            }
+        }).detach();
+    }
+    
+    void processConsole() {
+        if (!console) return;
+        std::vector<std::string> lines;
+        {
+            std::lock_guard<std::mutex> lock(console->mutex);
+            lines.swap(console->lines);
+        }
+        for (const auto& line : lines) runCommand(line);
+    }
+    
+    void runCommand(const std::string& line) {
+        std::istringstream in(line);
+        std::string command;
+        if (!(in >> command)) return;
+        
+        // Sphere index, or "light" for the point light
+        auto readObject = [&in](int& object) {
+            std::string token;
+            if (!(in >> token)) return false;
+            if (token == "light") {
+                object = AnimationTrack::kLight;
+                return true;
+            }
+            char* end = nullptr;
+            object = (int)strtol(token.c_str(), &end, 10);
+            return *end == '\0' && object >= 0;
+        };
+        auto report = [this](const std::string& what, SceneUpdate update) {
+            std::cout << what << " (" << sceneUpdateName(update) << ", scene version " << scene_store.snapshot()->version << ")" << std::endl;
+        };
+        
+        int id = 0;
+        Vec3 p;
+        Color c;
+        if (command == "help") {
+            std::cout << "Scene editing commands:" << std::endl;
+            std::cout << "  list" << std::endl;
+            std::cout << "  add <x> <y> <z> <radius> [<r> <g> <b>]" << std::endl;
+            std::cout << "  remove <id>" << std::endl;
+            std::cout << "  move <id|light> <x> <y> <z>" << std::endl;
+            std::cout << "  color <id> <r> <g> <b>" << std::endl;
+            std::cout << "  material <id> diffuse | metal <roughness> | glass <ior> [<roughness>] | coated <ior> <roughness>" << std::endl;
+            std::cout << "  key <id|light> <time> <x> <y> <z>   (keyframe; replaces procedural motion)" << std::endl;
+            std::cout << "  still <id|light>                    (stop animating)" << std::endl;
+        } else if (command == "list") {
+            std::shared_ptr<const SceneState> latest = scene_store.snapshot();
+            const int kListed = 32;
+            for (int i = 0; i < (int)latest->spheres().size() && i < kListed; ++i) {
+                const Sphere& sphere = latest->spheres()[i];
+                std::cout << "  " << i << ": centre (" << sphere.center.x << ", " << sphere.center.y << ", " << sphere.center.z
+                          << ") radius " << sphere.radius << " " << materialTypeName(sphere.material.type) << std::endl;
+            }
+            if ((int)latest->spheres().size() > kListed) std::cout << "  ... " << latest->spheres().size() - kListed << " more" << std::endl;
+            std::cout << "  light: (" << latest->light_pos.x << ", " << latest->light_pos.y << ", " << latest->light_pos.z << ")" << std::endl;
+        } else if (command == "add") {
+            float radius;
+            if (!(in >> p.x >> p.y >> p.z >> radius) || radius <= 0.0f) {
+                std::cout << "usage: add <x> <y> <z> <radius> [<r> <g> <b>]" << std::endl;
+                return;
+            }
+            if (!(in >> c.r >> c.g >> c.b)) c = Color(0.8f, 0.8f, 0.8f);
+            SceneUpdate update = addSphere(Sphere(p, radius, c), id);
+            report("Added sphere " + std::to_string(id), update);
+        } else if (command == "remove") {
+            if (!(in >> id) || id < 0 || id >= sphereCount()) {
+                std::cout << "usage: remove <id>, with id below " << sphereCount() << std::endl;
+                return;
+            }
+            int last = sphereCount() - 1;
+            SceneUpdate update = removeSphere(id);
+            report("Removed sphere " + std::to_string(id) + (last != id ? "; sphere " + std::to_string(last) + " is now " + std::to_string(id) : ""), update);
+        } else if (command == "move") {
+            if (!readObject(id) || !(in >> p.x >> p.y >> p.z) || id >= sphereCount()) {
+                std::cout << "usage: move <id|light> <x> <y> <z>" << std::endl;
+                return;
+            }
+            if (id == AnimationTrack::kLight) report("Moved the light", moveLight(p));
+            else report("Moved sphere " + std::to_string(id), moveSphere(id, p));
+        } else if (command == "color") {
+            if (!(in >> id >> c.r >> c.g >> c.b) || id < 0 || id >= sphereCount()) {
+                std::cout << "usage: color <id> <r> <g> <b>" << std::endl;
+                return;
+            }
+            report("Recoloured sphere " + std::to_string(id), setColor(id, c));
+        } else if (command == "material") {
+            bool valid = (in >> id) && id >= 0 && id < sphereCount();
+            std::vector<std::string> tokens;
+            for (std::string token; in >> token;) tokens.push_back(token);
+            size_t i = 0;
+            Material material = Material::lambert();
+            if (!valid || !parseMaterial(tokens, i, scene_store.snapshot()->spheres()[id].color, material) || i != tokens.size()) {
+                std::cout << "usage: material <id> diffuse | metal <roughness> | glass <ior> [<roughness>] | coated <ior> <roughness>" << std::endl;
+                return;
+            }
+            report("Changed the material of sphere " + std::to_string(id), setMaterial(id, material));
+        } else if (command == "key") {
+            float t;
+            if (!readObject(id) || !(in >> t >> p.x >> p.y >> p.z) || id >= sphereCount()) {
+                std::cout << "usage: key <id|light> <time> <x> <y> <z>" << std::endl;
+                return;
+            }
+            animation.addKey(id, Keyframe{t, p});
+            std::cout << "Keyframe at " << t << "s" << std::endl;
+        } else if (command == "still") {
+            if (!readObject(id) || id >= sphereCount()) {
+                std::cout << "usage: still <id|light>" << std::endl;
+                return;
+            }
+            animation.clear(id);
+            std::cout << "Animation stopped" << std::endl;
+        } else {
+            std::cout << "Unknown command '" << command << "'; type 'help'" << std::endl;
+        }
+    }
+    
+    // ---- Scene file hot reload ----
+    
+    // Reload whatever the watcher saw written: the scene file, or only the texture files
+    void processSceneFiles() {
+        if (scene_file.path.empty()) return;
+        for (const auto& path : file_watcher.changed()) {
+            if (path == scene_file.path) {
+                reloadSceneFile();
+                continue;
+            }
+            for (auto& texture : file_textures) {
+                if (texture.second.path == path) reloadTexture(texture.first);
+            }
+        }
+    }
+    
+    Sphere fileSphere(const SceneFileEntry& entry) const {
+        auto texture = file_textures.find(entry.name);
+        Sphere sphere(entry.position, entry.radius, entry.color, 0.0f, 0.0f, 1.0f,
+                      texture != file_textures.end() ? texture->second.texture.get() : nullptr);
+        sphere.setMaterial(entry.material);
+        return sphere;
+    }
+    
+    std::vector<std::shared_ptr<Texture>> fileTextureList() const {
+        std::vector<std::shared_ptr<Texture>> textures;
+        for (const auto& texture : file_textures) textures.push_back(texture.second.texture);
+        return textures;
+    }
+    
+    // Read a texture file named by the scene file, null if it cannot be loaded. Over the
+    // texture budget a new texture gives up its finest levels before any frame uses it.
+    static std::shared_ptr<Texture> loadFileTexture(const std::string& path) {
+        std::shared_ptr<Texture> texture = Texture::loadPPM(path);
+        if (!texture) {
+            std::cout << "Scene file: cannot load texture " << path << std::endl;
+            return texture;
+        }
+        while (memoryStats().overBudget(MemoryTag::Texture) && texture->dropLevel()) {}
+        return texture;
+    }
+    
+    // Load textures the scene file names for the first time or under a new path; returns
+    // whether the set changed
+    bool loadFileTextures() {
+        std::map<std::string, FileTexture> textures;
+        bool changed = false;
+        for (const auto& entry : scene_file.entries) {
+            if (entry.kind != SceneFileEntry::kTexture) continue;
+            auto current = file_textures.find(entry.name);
+            if (current != file_textures.end() && current->second.path == entry.path) {
+                textures[entry.name] = current->second;
+                continue;
+            }
+            FileTexture texture{entry.path, loadFileTexture(entry.path)};
+            file_watcher.watch(entry.path);
+            textures[entry.name] = texture;
+            changed = true;
+        }
+        changed = changed || textures.size() != file_textures.size();
+        file_textures.swap(textures);
+        return changed;
+    }
+    
+    // Parse the changed lines of the scene file and diff the result against the current
+    // scene. Sphere lines match scene spheres by order: a new position or radius refits,
+    // a new look patches the sphere, and lines added or removed at the end splice BVH
+    // leaves (or rebuild, past kMaxFileSplices). Everything lands in one scene version.
+    void reloadSceneFile() {
+        std::string error;
+        if (!scene_file.load(error)) {
+            std::cout << "Scene file: " << error << std::endl;
+            return;
+        }
+        applySceneFile();
+    }
+    
+    void applySceneFile() {
+        static const int kMaxFileSplices = 64;
+        bool textures_changed = loadFileTextures();
+        
+        std::vector<Sphere> wanted;
+        bool has_light = false;
+        Vec3 light;
+        for (const auto& entry : scene_file.entries) {
+            if (entry.kind == SceneFileEntry::kSphere) wanted.push_back(fileSphere(entry));
+            if (entry.kind == SceneFileEntry::kLight) {
+                has_light = true;
+                light = entry.position;
+            }
+        }
+        
+        std::shared_ptr<const SceneState> latest = scene_store.snapshot();
+        int common = (int)std::min(wanted.size(), file_spheres.size());
+        std::vector<int> moved, restyled;
+        for (int k = 0; k < common; ++k) {
+            if (file_spheres[k] < 0) continue;
+            const Sphere& current = latest->spheres()[file_spheres[k]];
+            if (!current.sameLook(wanted[k])) restyled.push_back(k);
+            if (current.center != wanted[k].center || current.radius != wanted[k].radius) moved.push_back(k);
+        }
+        int removed = (int)file_spheres.size() - common, added = (int)wanted.size() - common;
+        bool light_moved = has_light && light != latest->light_pos;
+        if (moved.empty() && restyled.empty() && removed == 0 && added == 0 && !light_moved && !textures_changed) {
+            std::cout << "Scene file: no changes" << std::endl;
+            return;
+        }
+        if (has_light) animation.clear(AnimationTrack::kLight);
+        
+        std::vector<int> ids;
+        std::vector<std::pair<int, int>> relabels;   // (removed index, former index of the sphere moved into it)
+        SceneUpdate update = SceneUpdate::None;
+        scene_store.update([&](SceneState& next) {
+            ids = file_spheres;
+            relabels.clear();
+            update = restyled.empty() && !textures_changed ? SceneUpdate::None : SceneUpdate::MaterialPatch;
+            bool rebuild = removed + added > kMaxFileSplices;
+            next.textures = fileTextureList();
+            if (has_light) next.light_pos = light;
+            
+            // Lines removed from the end; the last sphere fills each hole
+            while (ids.size() > wanted.size()) {
+                int id = ids.back();
+                ids.pop_back();
+                if (id < 0) continue;
+                std::vector<Sphere>& spheres = next.editSpheres();
+                int last = (int)spheres.size() - 1;
+                spheres[id] = spheres[last];
+                spheres.pop_back();
+                if (!rebuild) next.editBvh().remove(spheres, id, last);
+                for (int& other : ids) if (other == last) other = id;
+                relabels.emplace_back(id, last);
+                update = SceneUpdate::Remove;
+            }
+            
+            std::vector<int> moved_ids;
+            for (int k : restyled) {
+                Sphere& sphere = next.editSpheres()[ids[k]];
+                Sphere look = wanted[k];
+                look.center = sphere.center;
+                look.radius = sphere.radius;
+                sphere = look;
+            }
+            for (int k : moved) {
+                Sphere& sphere = next.editSpheres()[ids[k]];
+                sphere.center = wanted[k].center;
+                sphere.radius = wanted[k].radius;
+                moved_ids.push_back(ids[k]);
+            }
+            if (!moved_ids.empty()) {
+                if (!rebuild) next.editBvh().refit(next.spheres(), moved_ids);
+                update = std::max(update, SceneUpdate::Refit);
+            }
+            
+            for (size_t k = ids.size(); k < wanted.size(); ++k) {
+                std::vector<Sphere>& spheres = next.editSpheres();
+                ids.push_back((int)spheres.size());
+                spheres.push_back(wanted[k]);
+                if (!rebuild && !next.editBvh().insert(spheres, ids.back())) rebuild = true;
+                update = std::max(update, SceneUpdate::Insert);
+            }
+            
+            if (rebuild) {
+                rebuildBvh(next);
+                update = SceneUpdate::Rebuild;
+            } else if (update >= SceneUpdate::Refit) {
+                update = keepBvhQuality(next, update);
+            }
+        });
+        file_spheres = ids;
+        for (const auto& relabel : relabels) {
+            animation.clear(relabel.first);
+            animation.relabel(relabel.second, relabel.first);
+        }
+        
+        std::cout << "Scene file: parsed " << scene_file.parsed_lines << " of " << scene_file.lines << " lines | "
+                  << moved.size() << " moved, " << restyled.size() << " restyled, " << added << " added, " << removed
+                  << " removed (" << sceneUpdateName(update) << ", scene version " << scene_store.snapshot()->version << ")" << std::endl;
+    }
+    
+    // Swap a texture for a freshly loaded copy of its file. Only the spheres using it are
+    // patched; geometry and the BVH are untouched.
+    void reloadTexture(const std::string& name) {
+        FileTexture& entry = file_textures[name];
+        std::shared_ptr<Texture> texture = loadFileTexture(entry.path);
+        if (!texture) return;
+        Texture* previous = entry.texture.get();
+        entry.texture = texture;
+        
+        // Spheres naming a texture that failed to load have none; the diff assigns it
+        if (!previous) {
+            applySceneFile();
+            return;
+        }
+        scene_store.update([&](SceneState& next) {
+            next.textures = fileTextureList();
+            for (auto& sphere : next.editSpheres()) {
+                if (sphere.texture != previous) continue;
+                sphere.texture = texture.get();
+                sphere.setColor(sphere.color);
+            }
+        });
+        std::cout << "Texture " << name << " reloaded (" << sceneUpdateName(SceneUpdate::MaterialPatch)
+                  << ", scene version " << scene_store.snapshot()->version << ")" << std::endl;
+    }
+    
+    // Run fn(i) for i in [0, count), split into contiguous bands across the workers
+    template <typename Fn>
+    void parallelFor(int count, Fn&& fn) const {
+        ::parallelFor(count, renderThreads(), std::forward<Fn>(fn));
+    }
+    
+    // Workers the presenter warps with while the tracer thread runs: four keep a 1600x1200
+    // warp inside a 60 Hz vsync, and small machines give no more than half to it
+    int presentThreads() const { return std::max(1, std::min(4, thread_count / 2)); }
+    
+    // Workers for rendering: all of them, less the presenter's while timewarp is on
+    int renderThreads() const {
+        return tracing.load() ? std::max(1, thread_count - reprojector.threads) : thread_count;
+    }
+    
+    // Empty the path-space filter grid with all render workers; at full size it is about
+    // 20 MB, too much for one thread at the start of every frame
+    void clearPathFilter() {
+        const int chunks = 64;
+        size_t chunk = path_filter.capacity() / chunks;   // Tables have at least 2^10 cells
+        parallelFor(chunks, [this, chunk](int i) { path_filter.clear(i * chunk, (i + 1) * chunk); });
+    }
+    
+    // Empty the hit-point cache the same way; at full size it is over 10 MB
+    void clearHitCache() {
+        const int chunks = 64;
+        size_t chunk = hit_cache.capacity() / chunks;
+        parallelFor(chunks, [this, chunk](int i) { hit_cache.clear(i * chunk, (i + 1) * chunk); });
+        hit_cache.resetCounters();
+    }
+    
+    // Run fn(x, y, primary) for every pixel, through the tile scheduler or as static row
+    // bands. While capture_gbuffer is set, fn records the pixel's primary hit through primary
+    // and the hits are encoded into gbuffer a tile or row at a time; otherwise primary is null.
+    template <typename Fn>
+    void forEachPixel(Fn&& fn) {
+        if (tile_scheduling) {
+            tile_scheduler.run(width, height, renderThreads(), [this, &fn](const Tile& tile) {
+                int tile_width = tile.x1 - tile.x0;
+                GBuffer::Row hits(capture_gbuffer ? tile_width * (tile.y1 - tile.y0) : 0);
+                tile_scheduler.forEachPixel(tile, [&](int x, int y) {
+                    visitPixel(fn, x, y, hits, (y - tile.y0) * tile_width + x - tile.x0);
+                });
+                if (!capture_gbuffer) return;
+                for (int y = tile.y0; y < tile.y1; ++y) gbuffer.encodeSpan(y, tile.x0, hits, (y - tile.y0) * tile_width, tile_width);
+            });
+        } else {
+            parallelFor(height, [this, &fn](int y) {
+                GBuffer::Row hits(capture_gbuffer ? width : 0);
+                for (int x = 0; x < width; ++x) visitPixel(fn, x, y, hits, x);
+                if (capture_gbuffer) gbuffer.encodeRow(y, hits);
+            });
+        }
+    }
+    
+    // forEachPixel for passes that shade the frame buffer: fn(x, y, primary) returns the
+    // pixel's colour. Tiles are 8 to 32 px wide, 24 to 96 bytes of RGB per row, so workers
+    // writing neighbouring tiles pixel by pixel would keep taking cache lines from each
+    // other; each tile is shaded into an aligned buffer of its own and copied out a row at a
+    // time. Row bands need no staging, as frame buffer rows start on a cache line.
+    template <typename Fn>
+    void shadePixels(Fn&& fn) {
+        if (!tile_scheduling) {
+            forEachPixel([this, &fn](int x, int y, GBuffer::Hit* primary) { writePixel(x, y, fn(x, y, primary)); });
+            return;
+        }
+        tile_scheduler.run(width, height, renderThreads(), [this, &fn](const Tile& tile) {
+            int tile_width = tile.x1 - tile.x0;
+            GBuffer::Row hits(capture_gbuffer ? tile_width * (tile.y1 - tile.y0) : 0);
+            AlignedVector<unsigned char, MemoryTag::Frame> rgb((size_t)tile_width * (tile.y1 - tile.y0) * 3);
+            tile_scheduler.forEachPixel(tile, [&](int x, int y) {
+                int i = (y - tile.y0) * tile_width + x - tile.x0;
+                auto stage = [&](int x, int y, GBuffer::Hit* primary) { encodePixel(&rgb[(size_t)i * 3], fn(x, y, primary)); };
+                visitPixel(stage, x, y, hits, i);
+            });
+            for (int y = tile.y0; y < tile.y1; ++y) {
+                std::copy_n(&rgb[(size_t)(y - tile.y0) * tile_width * 3], tile_width * 3, framePixel(tile.x0, y));
+                if (capture_gbuffer) gbuffer.encodeSpan(y, tile.x0, hits, (y - tile.y0) * tile_width, tile_width);
+            }
+        });
+    }
+    
+    // fn(x, y, primary), staging the primary hit at hits[i] unless hits is empty
+    template <typename Fn>
+    static void visitPixel(Fn& fn, int x, int y, GBuffer::Row& hits, int i) {
+        if (hits.depth.empty()) {
+            fn(x, y, nullptr);
+            return;
+        }
+        GBuffer::Hit primary;
+        fn(x, y, &primary);
+        hits.set(i, primary);
+    }
+    
+    // Key the calling thread's random numbers to one sample of one pixel
+    void beginSample(int x, int y, int sample) const {
+        beginSample(x, y, width, sample);
+    }
+    
+    void beginSample(int x, int y, int row_width, int sample) const {
+        currentRandomStream() = RandomStream((uint32_t)(y * row_width + x), sample, frame_index, seed);
+    }
+    
+    // Sample hemisphere for global illumination
+    Vec3 sampleHemisphere(const Vec3& normal) const {
+        float r1 = random01();
+        float r2 = random01();
+        return cosineHemisphere(normal, r1, r2);
+    }
+    
+    Vec3 lightPosition() const {
+        return scene->light_pos;
+    }
+    
+    Color skyColor() const {
+        return Color(0.1f, 0.1f, 0.2f);
+    }
+    
+    // Closest sphere along the ray, or nullptr
+    const Sphere* intersectScene(const Ray& ray, float& closest_t) const {
+        int hit = scene->bvh().intersect(scene->spheres(), ray, closest_t);
+        return hit >= 0 ? &scene->spheres()[hit] : nullptr;
+    }
+    
+    // True when any sphere blocks the open segment between two points
+    bool occluded(const Vec3& from, const Vec3& to) const {
+        Vec3 d = to - from;
+        float dist = sqrt(d.dot(d));
+        return scene->bvh().occluded(scene->spheres(), Ray(from, d), dist - 0.001f);
+    }
+    
+    // Fresnel reflectance calculation
+    float fresnel(float cos_i, float eta) const {
+        float sin_t = eta * sqrt(std::max(0.0f, 1.0f - cos_i * cos_i));
+        if (sin_t >= 1.0f) return 1.0f; // Total internal reflection
+        
+        float cos_t = sqrt(std::max(0.0f, 1.0f - sin_t * sin_t));
+        float r_perp = (eta * cos_i - cos_t) / (eta * cos_i + cos_t);
+        float r_parallel = (cos_i - eta * cos_t) / (cos_i + eta * cos_t);
+        
+        return (r_perp * r_perp + r_parallel * r_parallel) * 0.5f;
+    }
+    
+    // Primary ray cone: zero width at the pinhole, spreading by one pixel per unit distance
+    // (the image plane is 2 units wide at z = -1)
+    static RayCone primaryCone(const Camera& camera) {
+        return RayCone(0.0f, 2.0f / camera.width);
+    }
+    
+    // Pick the shading LOD from how many cone footprints span the sphere's radius;
+    // secondary rays are additionally biased cheaper
+    ShadingLod selectLod(const Sphere& sphere, float footprint, int depth) const {
+        if (!lod_enabled || footprint <= 0.0f) return ShadingLod::Full;
+        
+        float projected_pixels = sphere.radius / footprint;
+        projected_pixels /= pow(lod_secondary_scale, (float)depth);
+        
+        if (projected_pixels < lod_diffuse_pixels) return ShadingLod::DiffuseOnly;
+        if (projected_pixels < lod_full_pixels) return ShadingLod::NoIndirect;
+        return ShadingLod::Full;
+    }
+    
+    // When first_hit is given, the GI term of this hit is returned through it instead of
+    // being added to the result (only used for primary rays). A view index marks primary
+    // rays of a multi-view frame: view 0 stores its view-independent terms in hit_cache and
+    // later views reuse them. primary, if given, receives the G-buffer record of this hit.
+    Color trace(const Ray& ray, const RayCone& cone, int depth = 0, FirstHitGI* first_hit = nullptr, int view = -1,
+                GBuffer::Hit* primary = nullptr) const {
+        if (depth > quality.max_depth) return skyColor();
+        currentRandomStream().bounce = depth;
+        
+        // Find closest intersection
+        float closest_t;
+        const Sphere* hit_sphere = intersectScene(ray, closest_t);
+        
+        if (!hit_sphere) return skyColor();
+        
+        Vec3 hit_point = ray.at(closest_t);
+        Vec3 normal = hit_sphere->normal(hit_point);
+        float footprint = cone.widthAt(closest_t);
+        float curvature = 1.0f / hit_sphere->radius;
+        ShadingLod lod = selectLod(*hit_sphere, footprint, depth);
+        Color material_color = lod == ShadingLod::DiffuseOnly ? hit_sphere->lod_color : hit_sphere->getColor(hit_point, footprint);
+        
+        // Basic lighting
+        Vec3 light_pos = lightPosition();
+        Vec3 light_dir = (light_pos - hit_point).normalize();
+        
+        // Another view may already have shaded this surface cell
+        int object = (int)(hit_sphere - scene->spheres().data());
+        if (primary) {
+            primary->depth = closest_t;
+            primary->normal = normal;
+            primary->albedo = material_color;
+            primary->object = object;
+        }
+        bool share = view >= 0 && depth == 0 && lod != ShadingLod::DiffuseOnly;
+        uint64_t share_key = share ? PathSpaceFilter::cellKey(hit_point, normal, footprint) : 0;
+        const HitPointCache::Entry* shared = share && view > 0 ? hit_cache.find(share_key, object) : nullptr;
+        
+        // Shadow test
+        bool in_shadow;
+        if (shared) {
+            in_shadow = shared->in_shadow;
+        } else {
+            Ray shadow_ray(hit_point + normal * 0.001f, light_dir);
+            in_shadow = scene->bvh().occluded(scene->spheres(), shadow_ray, 1e30f, object);
+        }
+        
+        float light_intensity = in_shadow ? 0.1f : std::max(0.1f, normal.dot(light_dir));
+        Color final_color = material_color * light_intensity;
+        
+        // Distant impostors stop here: no secondary rays at all
+        if (lod == ShadingLod::DiffuseOnly) return final_color.clamp();
+        
+        // Handle reflections
+        if (hit_sphere->metallic > 0.0f) {
+            Vec3 reflect_dir = ray.direction.reflect(normal);
+            Ray reflect_ray(hit_point + normal * 0.001f, reflect_dir);
+            Color reflect_color = trace(reflect_ray, cone.reflect(closest_t, curvature), depth + 1);
+            final_color = final_color * (1.0f - hit_sphere->metallic) + reflect_color * hit_sphere->metallic;
+        }
+        
+        // Handle transparency and refraction
+        if (hit_sphere->transparency > 0.0f) {
+            Vec3 view_dir = ray.direction * -1.0f;
+            float cos_i = view_dir.dot(normal);
+            float eta = cos_i > 0 ? 1.0f / hit_sphere->refractive_index : hit_sphere->refractive_index;
+            Vec3 refract_normal = cos_i > 0 ? normal : normal * -1.0f;
+            
+            Vec3 refract_dir = ray.direction.refract(refract_normal, eta);
+            if (refract_dir.x != 0 || refract_dir.y != 0 || refract_dir.z != 0) {
+                Ray refract_ray(hit_point - refract_normal * 0.001f, refract_dir);
+                float fresnel_factor = fresnel(abs(cos_i), eta);
+                Vec3 reflect_dir = ray.direction.reflect(normal);
+                Ray reflect_ray(hit_point + refract_normal * 0.001f, reflect_dir);
+                
+                Color transparent_color;
+                if (stochastic_dielectric) {
+                    // Follow one branch, chosen with probability equal to its Fresnel weight; weight
+                    // and probability cancel, so the expected colour is the blend below at linear cost
+                    if (random01() < fresnel_factor) {
+                        transparent_color = trace(reflect_ray, cone.reflect(closest_t, curvature), depth + 1);
+                    } else {
+                        transparent_color = trace(refract_ray, cone.refract(closest_t, curvature, eta), depth + 1);
+                    }
+                } else {
+                    // Fresnel blend
+                    Color refract_color = trace(refract_ray, cone.refract(closest_t, curvature, eta), depth + 1);
+                    Color reflect_color = trace(reflect_ray, cone.reflect(closest_t, curvature), depth + 1);
+                    transparent_color = reflect_color * fresnel_factor + refract_color * (1.0f - fresnel_factor);
+                }
+                final_color = final_color * (1.0f - hit_sphere->transparency) + transparent_color * hit_sphere->transparency;
+            }
+        }
+        
+        // Global illumination
+        HitPointCache::Entry entry;
+        if (quality.gi && depth < 3 && hit_sphere->metallic < 0.5f && lod == ShadingLod::Full) {
+            Color gi_color;
+            if (shared && shared->has_gi) {
+                gi_color = shared->gi;
+            } else {
+                Vec3 random_dir = sampleHemisphere(normal);
+                Ray gi_ray(hit_point + normal * 0.001f, random_dir);
+                gi_color = trace(gi_ray, cone.scatter(closest_t, diffuse_cone_angle), depth + 1);
+            }
+            entry.has_gi = true;
+            entry.gi = gi_color;
+            if (first_hit) {
+                first_hit->valid = true;
+                first_hit->position = hit_point;
+                first_hit->normal = normal;
+                first_hit->footprint = footprint;
+                first_hit->weight = material_color * 0.1f;
+                first_hit->radiance = gi_color;
+            } else {
+                final_color = final_color + gi_color * material_color * 0.1f;
+            }
+        }
+        
+        if (share && view == 0) {
+            const RandomStream& stream = currentRandomStream();
+            entry.object = object;
+            entry.in_shadow = in_shadow;
+            hit_cache.store(share_key, (uint64_t)stream.pixel << 32 | stream.sample, entry);
+        }
+        
+        return final_color.clamp();
+    }
+    
+    // Average the frame's jittered samples. Given filtered_out, first-hit GI is pooled
+    // into the path-space filter grid and the pixel's remaining terms go to *filtered_out.
+    // view is the camera's index in a multi-view frame (-1 for a single view). Given primary,
+    // the first hit of sample 0 is recorded there; its ray keeps its jitter, so capturing
+    // leaves the image unchanged.
+    Color renderPixel(const Camera& camera, int x, int y, FilteredPixel* filtered_out, int view = -1,
+                      GBuffer::Hit* primary = nullptr) {
+        Color pixel_color;
+        FilteredPixel filtered;
+        int samples = quality.samples > 0 ? quality.samples : samples_per_pixel;
+        
+        // Anti-aliasing: multiple samples per pixel
+        for (int sample = 0; sample < samples; ++sample) {
+            beginSample(x, y, camera.width, sample);
+            
+            // Random jitter for anti-aliasing
+            float jitter_x = random01() - 0.5f;
+            float jitter_y = random01() - 0.5f;
+            Ray ray = camera.ray(x + jitter_x, y + jitter_y);
+            
+            FirstHitGI gi;
+            Color sample_color = trace(ray, primaryCone(camera), 0, filtered_out ? &gi : nullptr, view,
+                                       sample == 0 ? primary : nullptr);
+            if (gi.valid) {
+                // Jitter the lookup by up to half a cell to break up the grid structure
+                float cell_size = gi.footprint * path_filter_radius;
+                Vec3 jitter(random01() - 0.5f, random01() - 0.5f, random01() - 0.5f);
+                uint64_t key = PathSpaceFilter::cellKey(gi.position + jitter * cell_size, gi.normal, cell_size);
+                int slot = path_filter.insert(key, gi.radiance);
+                int term = slot < 0 ? -1 : filtered.term(slot);
+                if (term < 0) {
+                    sample_color = sample_color + gi.weight * gi.radiance;
+                } else {
+                    filtered.weight[term] = filtered.weight[term] + gi.weight;
+                }
+            }
+            pixel_color = pixel_color + sample_color;
+        }
+        
+        // Average the samples
+        pixel_color = pixel_color * (1.0f / samples);
+        
+        if (filtered_out) {
+            filtered.base = pixel_color;
+            for (int i = 0; i < filtered.cells; ++i) filtered.weight[i] = filtered.weight[i] * (1.0f / samples);
+            *filtered_out = filtered;
+        }
+        return pixel_color;
+    }
+    
+    // Final colour of a filtered pixel once every sample is in the grid
+    Color resolveFiltered(const FilteredPixel& pixel) const {
+        Color pixel_color = pixel.base;
+        for (int i = 0; i < pixel.cells; ++i) pixel_color = pixel_color + pixel.weight[i] * path_filter.average(pixel.slot[i]);
+        return pixel_color.clamp();
+    }
+    
+    static void encodePixel(unsigned char* rgb, const Color& pixel_color) {
+        rgb[0] = (unsigned char)(pixel_color.r * 255);
+        rgb[1] = (unsigned char)(pixel_color.g * 255);
+        rgb[2] = (unsigned char)(pixel_color.b * 255);
+    }
+    
+    void resizeFrameBuffer() {
+        frame_row_length = (width + 63) / 64 * 64;
+        frameBuffer.assign((size_t)frame_row_length * height * 3, 0);
+    }
+    
+    unsigned char* framePixel(int x, int y) {
+        return &frameBuffer[((size_t)y * frame_row_length + x) * 3];
+    }
+    
+    void writePixel(int x, int y, const Color& pixel_color) {
+        encodePixel(framePixel(x, y), pixel_color);
+    }
+    
+    // ---- Unidirectional path tracing ----
+    //
+    // One importance-sampled BSDF direction per bounce instead of the branching of trace(),
+    // with next-event estimation towards the point light and Russian roulette. Covers the
+    // same path space as the bidirectional engine up to bdpt_max_depth bounces.
+    
+    Color tracePath(Ray ray, Sampler& sampler, GBuffer::Hit* primary = nullptr) const {
+        Color L;
+        Color beta(1.0f, 1.0f, 1.0f);
+        for (int depth = 0; ; ++depth) {
+            currentRandomStream().bounce = depth;
+            float t;
+            const Sphere* hit = intersectScene(ray, t);
+            if (!hit) {
+                L = L + beta * skyColor();
+                break;
+            }
+            if (depth >= bdpt_max_depth) break;
+            
+            Vec3 p = ray.at(t);
+            Vec3 n = hit->normal(p);
+            Vec3 wo = ray.direction * -1.0f;
+            Bsdf bsdf = hit->bsdfAt(p);
+            if (primary && depth == 0) {
+                primary->depth = t;
+                primary->normal = n;
+                primary->albedo = hit->getColor(p);
+                primary->object = (int)(hit - scene->spheres().data());
+            }
+            
+            if (!bsdf.isDelta()) {
+                Vec3 light_pos = lightPosition();
+                Vec3 d = light_pos - p;
+                float dist2 = d.dot(d);
+                Vec3 wi = d * (1.0f / sqrt(dist2));
+                Color f = bsdf.f(wo, wi, true);
+                Vec3 origin = p + n * (wi.dot(n) > 0 ? 0.001f : -0.001f);
+                if (f.r + f.g + f.b > 0.0f && !occluded(origin, light_pos)) {
+                    L = L + beta * f * light_intensity * (std::abs(wi.dot(n)) / dist2);
+                }
+            }
+            
+            float u_lobe = sampler.next();
+            float u1 = sampler.next();
+            float u2 = sampler.next();
+            BsdfSample bs;
+            if (!bsdf.sample(wo, u_lobe, u1, u2, true, bs)) break;
+            beta = beta * bs.weight;
+            
+            if (depth >= 3) {
+                float q = std::max(0.05f, 1.0f - std::max(beta.r, std::max(beta.g, beta.b)));
+                if (sampler.next() < q) break;
+                beta = beta * (1.0f / (1.0f - q));
+            }
+            ray = Ray(p + n * (bs.wi.dot(n) > 0 ? 0.001f : -0.001f), bs.wi);
+        }
+        return L;
+    }
+    
+    // Mean radiance of samples_per_pixel paths through pixel (x, y), unclamped. Given primary,
+    // the first hit of sample 0 is recorded there.
+    Color renderPixelPathTraced(const Camera& camera, int x, int y, GBuffer::Hit* primary = nullptr) const {
+        IndependentSampler sampler;
+        Color pixel_color;
+        for (int sample = 0; sample < samples_per_pixel; ++sample) {
+            beginSample(x, y, camera.width, sample);
+            float raster_x = x + sampler.next() - 0.5f;
+            float raster_y = y + sampler.next() - 0.5f;
+            pixel_color = pixel_color + tracePath(camera.ray(raster_x, raster_y), sampler, sample == 0 ? primary : nullptr);
+        }
+        return pixel_color * (1.0f / samples_per_pixel);
+    }
+    
+    void renderPathTraced() {
+        beginAccumulation();
+        Camera camera(scene->camera_pos, width, height);
+        forEachPixel([this, &camera](int x, int y, GBuffer::Hit* primary) {
+            addToAccumulation(x, y, renderPixelPathTraced(camera, x, y, primary));
+        });
+        resolveAccumulation(1.0f / accumulated_frames);
+    }
+    
+    // ---- Bidirectional path tracing ----
+    //
+    // Light subpaths start at the point light, camera subpaths at the pinhole, and every pair
+    // of prefixes is connected and weighted with the power heuristic. The sky is only
+    // reachable by camera paths escaping the scene, so those contributions need no MIS weight.
+    
+    // Offset a ray origin off the surface on the side the direction leaves through
+    static Vec3 offsetOrigin(const PathVertex& v, const Vec3& dir) {
+        if (!v.onSurface()) return v.p;
+        return v.p + v.n * (dir.dot(v.n) > 0 ? 0.001f : -0.001f);
+    }
+    
+    static bool isConnectible(const PathVertex& v) {
+        return !v.onSurface() || !v.bsdf.isDelta();
+    }
+    
+    // Pinhole camera at camera_pos looking down -z; the image plane at distance 1 spans
+    // [-1, 1] horizontally, matching the primary rays in renderPixel()
+    float imagePlaneArea() const {
+        return 4.0f * height / width;
+    }
+    
+    // Map a direction leaving the camera to a pixel; false when it misses the image
+    bool cameraRaster(const Vec3& dir, int& px, int& py) const {
+        if (dir.z >= 0.0f) return false;
+        float u = dir.x / -dir.z;
+        float v = -dir.y / -dir.z * width / height;
+        px = (int)std::floor((u + 1.0f) * 0.5f * width + 0.5f);
+        py = (int)std::floor((v + 1.0f) * 0.5f * height + 0.5f);
+        return px >= 0 && px < width && py >= 0 && py < height;
+    }
+    
+    // Solid-angle density of the camera generating dir: 1 / (A cos^3)
+    float cameraPdfDir(const Vec3& dir) const {
+        int px, py;
+        if (!cameraRaster(dir, px, py)) return 0.0f;
+        float cos_theta = -dir.z;
+        return 1.0f / (imagePlaneArea() * cos_theta * cos_theta * cos_theta);
+    }
+    
+    // Convert a solid-angle density at from into an area density at next
+    static float convertDensity(float pdf, const Vec3& from, const PathVertex& next) {
+        Vec3 w = next.p - from;
+        float dist2 = w.dot(w);
+        if (dist2 == 0.0f) return 0.0f;
+        if (next.onSurface()) pdf *= std::abs(next.n.dot(w * (1.0f / sqrt(dist2))));
+        return pdf / dist2;
+    }
+    
+    // Area density of vertex v generating next, given the vertex it was reached from
+    float vertexPdf(const PathVertex& v, const PathVertex* prev, const PathVertex& next) const {
+        Vec3 wn = (next.p - v.p).normalize();
+        float pdf;
+        if (v.type == VertexType::Light) {
+            pdf = 1.0f / (4.0f * M_PI); // Point light emits uniformly
+        } else if (v.type == VertexType::Camera) {
+            pdf = cameraPdfDir(wn);
+        } else {
+            pdf = v.bsdf.pdf((prev->p - v.p).normalize(), wn);
+        }
+        return convertDensity(pdf, v.p, next);
+    }
+    
+    // Extend a subpath by sampling the material at each hit. Camera subpaths that leave the
+    // scene add the sky through escaped.
+    void randomWalk(Ray ray, Color beta, float pdf_dir, int max_bounces, bool radiance,
+                    Sampler& sampler, std::vector<PathVertex>& path, Color* escaped) const {
+        if (max_bounces <= 0) return;
+        int bounces = 0;
+        float pdf_fwd = pdf_dir;
+        while (true) {
+            currentRandomStream().bounce = bounces;
+            float t;
+            const Sphere* hit = intersectScene(ray, t);
+            if (!hit) {
+                if (escaped) *escaped = *escaped + beta * skyColor();
+                break;
+            }
+            
+            PathVertex vertex;
+            vertex.p = ray.at(t);
+            vertex.n = hit->normal(vertex.p);
+            vertex.wo = ray.direction * -1.0f;
+            vertex.sphere = hit;
+            vertex.bsdf = hit->bsdfAt(vertex.p);
+            vertex.beta = beta;
+            vertex.pdf_fwd = convertDensity(pdf_fwd, path.back().p, vertex);
+            path.push_back(vertex);
+            if (++bounces >= max_bounces) break;
+            
+            PathVertex& v = path.back();
+            float u_lobe = sampler.next();
+            float u1 = sampler.next();
+            float u2 = sampler.next();
+            BsdfSample bs;
+            if (!v.bsdf.sample(v.wo, u_lobe, u1, u2, radiance, bs)) break;
+            beta = beta * bs.weight;
+            
+            float pdf_rev = 0.0f;
+            if (bs.specular) {
+                v.delta = true;
+            } else {
+                pdf_rev = v.bsdf.pdf(bs.wi, v.wo);
+            }
+            PathVertex& prev = path[path.size() - 2];
+            prev.pdf_rev = convertDensity(pdf_rev, v.p, prev);
+            
+            pdf_fwd = bs.pdf;
+            ray = Ray(offsetOrigin(v, bs.wi), bs.wi);
+        }
+    }
+    
+    // Primary ray through continuous raster position (raster_x, raster_y), where pixel x
+    // covers [x - 0.5, x + 0.5)
+    Ray cameraRay(float raster_x, float raster_y) const {
+        return Camera(scene->camera_pos, width, height).ray(raster_x, raster_y);
+    }
+    
+    // Camera subpath through a raster position; returns escaped sky radiance
+    Color generateCameraSubpath(float raster_x, float raster_y, int max_bounces, Sampler& sampler,
+                                std::vector<PathVertex>& path) const {
+        Ray ray = cameraRay(raster_x, raster_y);
+        
+        PathVertex camera;
+        camera.type = VertexType::Camera;
+        camera.p = scene->camera_pos;
+        camera.beta = Color(1.0f, 1.0f, 1.0f);
+        path.push_back(camera);
+        
+        Color escaped;
+        randomWalk(ray, camera.beta, cameraPdfDir(ray.direction), max_bounces, true, sampler, path, &escaped);
+        return escaped;
+    }
+    
+    void generateLightSubpath(int max_bounces, Sampler& sampler, std::vector<PathVertex>& path) const {
+        PathVertex light;
+        light.type = VertexType::Light;
+        light.p = lightPosition();
+        light.beta = light_intensity;
+        light.pdf_fwd = 1.0f; // Single light with a delta position
+        path.push_back(light);
+        
+        // Uniform direction on the sphere
+        float z = 1.0f - 2.0f * sampler.next();
+        float r = sqrt(std::max(0.0f, 1.0f - z * z));
+        float phi = 2.0f * M_PI * sampler.next();
+        Vec3 dir(r * cos(phi), r * sin(phi), z);
+        float pdf_dir = 1.0f / (4.0f * M_PI);
+        randomWalk(Ray(light.p, dir), light_intensity * (1.0f / pdf_dir), pdf_dir, max_bounces, false,
+                   sampler, path, nullptr);
+    }
+    
+    // Power-heuristic weight of the strategy that connects light prefix s with camera prefix t.
+    // Only the two connection vertices and their predecessors change their reverse densities,
+    // so those are updated on copies instead of the stored paths.
+    float misWeight(const std::vector<PathVertex>& light_path, const std::vector<PathVertex>& camera_path,
+                    const PathVertex& sampled, int s, int t) const {
+        if (s + t == 2) return 1.0f;
+        
+        PathVertex qs = s == 1 ? sampled : light_path[s - 1];
+        PathVertex pt = t == 1 ? sampled : camera_path[t - 1];
+        PathVertex qs_minus = s > 1 ? light_path[s - 2] : PathVertex();
+        PathVertex pt_minus = t > 1 ? camera_path[t - 2] : PathVertex();
+        
+        // Connection vertices are never degenerate for this strategy
+        qs.delta = false;
+        pt.delta = false;
+        pt.pdf_rev = vertexPdf(qs, s > 1 ? &qs_minus : nullptr, pt);
+        if (t > 1) pt_minus.pdf_rev = vertexPdf(pt, &qs, pt_minus);
+        qs.pdf_rev = vertexPdf(pt, t > 1 ? &pt_minus : nullptr, qs);
+        if (s > 1) qs_minus.pdf_rev = vertexPdf(qs, &pt, qs_minus);
+        
+        auto cameraVertex = [&](int i) -> const PathVertex& {
+            return i == t - 1 ? pt : (i == t - 2 ? pt_minus : camera_path[i]);
+        };
+        auto lightVertex = [&](int i) -> const PathVertex& {
+            return i == s - 1 ? qs : (i == s - 2 ? qs_minus : light_path[i]);
+        };
+        auto remap0 = [](float f) { return f != 0.0f ? f : 1.0f; };
+        
+        float sum_ri = 0.0f;
+        float ri = 1.0f;
+        for (int i = t - 1; i > 0; --i) {
+            ri *= remap0(cameraVertex(i).pdf_rev) / remap0(cameraVertex(i).pdf_fwd);
+            if (!cameraVertex(i).delta && !cameraVertex(i - 1).delta) sum_ri += ri * ri;
+        }
+        ri = 1.0f;
+        for (int i = s - 1; i >= 0; --i) {
+            ri *= remap0(lightVertex(i).pdf_rev) / remap0(lightVertex(i).pdf_fwd);
+            // The point light itself can never be hit, so strategies ending on it are skipped
+            bool delta_predecessor = i > 0 ? lightVertex(i - 1).delta : true;
+            if (!lightVertex(i).delta && !delta_predecessor) sum_ri += ri * ri;
+        }
+        return 1.0f / (1.0f + sum_ri);
+    }
+    
+    // Contribution of connecting light prefix s (s >= 1) with camera prefix t (t >= 1).
+    // For t == 1 the result belongs to pixel (splat_x, splat_y) instead of the current one.
+    Color connectBDPT(const std::vector<PathVertex>& light_path, const std::vector<PathVertex>& camera_path,
+                      int s, int t, int& splat_x, int& splat_y) const {
+        PathVertex sampled;
+        Color L;
+        if (t == 1) {
+            // Light tracing: connect the light vertex straight to the pinhole
+            const PathVertex& qs = light_path[s - 1];
+            if (!isConnectible(qs)) return Color();
+            Vec3 d = qs.p - scene->camera_pos;
+            float dist2 = d.dot(d);
+            Vec3 dir = d * (1.0f / sqrt(dist2));
+            if (!cameraRaster(dir, splat_x, splat_y)) return Color();
+            
+            float cos_camera = -dir.z;
+            float importance = 1.0f / (imagePlaneArea() * cos_camera * cos_camera * cos_camera * cos_camera);
+            sampled.type = VertexType::Camera;
+            sampled.p = scene->camera_pos;
+            sampled.beta = Color(1.0f, 1.0f, 1.0f) * (importance * cos_camera / dist2);
+            
+            Vec3 wi = dir * -1.0f;
+            L = qs.beta * qs.bsdf.f(qs.wo, wi, false) * sampled.beta * std::abs(wi.dot(qs.n));
+            if (L.r + L.g + L.b <= 0.0f || occluded(offsetOrigin(qs, wi), scene->camera_pos)) return Color();
+        } else if (s == 1) {
+            // Next-event estimation towards the point light
+            const PathVertex& pt = camera_path[t - 1];
+            if (!isConnectible(pt)) return Color();
+            Vec3 light_pos = lightPosition();
+            Vec3 d = light_pos - pt.p;
+            float dist2 = d.dot(d);
+            Vec3 wi = d * (1.0f / sqrt(dist2));
+            
+            sampled.type = VertexType::Light;
+            sampled.p = light_pos;
+            sampled.beta = light_intensity * (1.0f / dist2);
+            sampled.pdf_fwd = 1.0f;
+            
+            L = pt.beta * pt.bsdf.f(pt.wo, wi, true) * sampled.beta * std::abs(wi.dot(pt.n));
+            if (L.r + L.g + L.b <= 0.0f || occluded(offsetOrigin(pt, wi), light_pos)) return Color();
+        } else {
+            // Join two surface vertices
+            const PathVertex& qs = light_path[s - 1];
+            const PathVertex& pt = camera_path[t - 1];
+            if (!isConnectible(qs) || !isConnectible(pt)) return Color();
+            Vec3 d = qs.p - pt.p;
+            float dist2 = d.dot(d);
+            Vec3 dir = d * (1.0f / sqrt(dist2));
+            float g = std::abs(dir.dot(pt.n)) * std::abs(dir.dot(qs.n)) / dist2;
+            
+            L = qs.beta * qs.bsdf.f(qs.wo, dir * -1.0f, false) * pt.bsdf.f(pt.wo, dir, true) * pt.beta * g;
+            if (L.r + L.g + L.b <= 0.0f || occluded(offsetOrigin(pt, dir), offsetOrigin(qs, dir * -1.0f))) return Color();
+        }
+        return L * misWeight(light_path, camera_path, sampled, s, t);
+    }
+    
+    void addToAccumulation(int x, int y, const Color& c) {
+        size_t index = ((size_t)y * width + x) * 3;
+        atomicAdd(accumulation[index], c.r);
+        atomicAdd(accumulation[index + 1], c.g);
+        atomicAdd(accumulation[index + 2], c.b);
+    }
+    
+    // One light subpath per camera sample; light-tracing splats land in other pixels'
+    // accumulation entries, so both go through the same lock-free buffer. Given primary,
+    // the first surface vertex of sample 0's camera subpath is recorded there.
+    void renderPixelBidirectional(int x, int y, GBuffer::Hit* primary) {
+        IndependentSampler sampler;
+        std::vector<PathVertex> camera_path, light_path;
+        camera_path.reserve(bdpt_max_depth + 2);
+        light_path.reserve(bdpt_max_depth + 1);
+        float sample_weight = 1.0f / samples_per_pixel;
+        
+        for (int sample = 0; sample < samples_per_pixel; ++sample) {
+            beginSample(x, y, sample);
+            camera_path.clear();
+            light_path.clear();
+            float raster_x = x + sampler.next() - 0.5f;
+            float raster_y = y + sampler.next() - 0.5f;
+            Color L = generateCameraSubpath(raster_x, raster_y, bdpt_max_depth + 1, sampler, camera_path);
+            if (primary && sample == 0 && camera_path.size() > 1 && camera_path[1].onSurface()) {
+                const PathVertex& v = camera_path[1];
+                Vec3 d = v.p - camera_path[0].p;
+                primary->depth = sqrt(d.dot(d));
+                primary->normal = v.sphere->normal(v.p);
+                primary->albedo = v.sphere->getColor(v.p);
+                primary->object = (int)(v.sphere - scene->spheres().data());
+            }
+            generateLightSubpath(bdpt_max_depth, sampler, light_path);
+            
+            for (int t = 1; t <= (int)camera_path.size(); ++t) {
+                for (int s = 1; s <= (int)light_path.size(); ++s) {
+                    int depth = s + t - 2;
+                    if ((s == 1 && t == 1) || depth > bdpt_max_depth) continue;
+                    int splat_x, splat_y;
+                    Color c = connectBDPT(light_path, camera_path, s, t, splat_x, splat_y);
+                    if (t == 1) {
+                        if (c.r + c.g + c.b > 0.0f) addToAccumulation(splat_x, splat_y, c * sample_weight);
+                    } else {
+                        L = L + c;
+                    }
+                }
+            }
+            addToAccumulation(x, y, L * sample_weight);
+        }
+    }
+    
+    // Start the next progressive frame, restarting from zero when the accumulated frames
+    // no longer show the same image: a new scene version, another engine, a different
+    // sample count or a resized frame
+    void beginAccumulation() {
+        if (accumulated_frames == 0 || scene->version != accumulated_version || engine != accumulated_engine ||
+            samples_per_pixel != accumulated_samples || (size_t)width * height * 3 != accumulation_size) {
+            clearAccumulation();
+            accumulated_version = scene->version;
+            accumulated_engine = engine;
+            accumulated_samples = samples_per_pixel;
+            accumulated_frames = 0;
+            accumulated_brightness = 0.0f;
+        }
+        ++accumulated_frames;
+    }
+    
+    void clearAccumulation() {
+        size_t size = (size_t)width * height * 3;
+        if (accumulation_size != size) {
+            AlignedVector<std::atomic<int64_t>, MemoryTag::Frame>(size).swap(accumulation);
+            accumulation_size = size;
+        }
+        for (size_t i = 0; i < size; ++i) accumulation[i].store(0, std::memory_order_relaxed);
+    }
+    
+    // Scale the accumulated radiance into the frame buffer; every worker has joined by now,
+    // so all splats are visible
+    void resolveAccumulation(float scale) {
+        parallelFor(height, [this, scale](int y) {
+            for (int x = 0; x < width; ++x) {
+                size_t index = ((size_t)y * width + x) * 3;
+                Color c(fromFixedPoint(accumulation[index]), fromFixedPoint(accumulation[index + 1]),
+                        fromFixedPoint(accumulation[index + 2]));
+                writePixel(x, y, (c * scale).clamp());
+            }
+        });
+    }
+    
+    void renderBidirectional() {
+        beginAccumulation();
+        auto shade = [this](int x, int y, GBuffer::Hit* primary) { renderPixelBidirectional(x, y, primary); };
+        parallelFor(height, [this, &shade](int y) {
+            GBuffer::Row hits(capture_gbuffer ? width : 0);
+            for (int x = 0; x < width; ++x) visitPixel(shade, x, y, hits, x);
+            if (capture_gbuffer) gbuffer.encodeRow(y, hits);
+        });
+        resolveAccumulation(1.0f / accumulated_frames);
+    }
+    
+    // ---- Metropolis light transport (PSSMLT) ----
+    //
+    // The bidirectional estimator for one strategy at a fixed depth becomes a deterministic
+    // function of the sampler's primary samples. A bootstrap pass estimates the image
+    // brightness b and seeds the chains proportionally to path luminance; chains then run
+    // independently and splat with the expected-value weights of Veach's MLT.
+    
+    enum { kCameraStream, kLightStream, kStreamCount };
+    
+    static float luminance(const Color& c) {
+        return 0.2126f * c.r + 0.7152f * c.g + 0.0722f * c.b;
+    }
+    
+    // Contribution of one randomly chosen strategy for paths with exactly depth bounces,
+    // already multiplied by the strategy count. The raster pixel is returned in (px, py).
+    Color metropolisPath(MLTSampler& sampler, int depth, int& px, int& py) const {
+        sampler.startStream(kCameraStream);
+        
+        // s == 0 stands for camera paths escaping to the sky
+        int s, t, strategies;
+        if (depth == 0) {
+            strategies = 1;
+            s = 0;
+            t = 2;
+        } else {
+            strategies = depth + 2;
+            s = std::min((int)(sampler.next() * strategies), strategies - 1);
+            t = strategies - s;
+        }
+        
+        float raster_x = sampler.next() * width - 0.5f;
+        float raster_y = sampler.next() * height - 0.5f;
+        px = std::min(width - 1, (int)std::floor(raster_x + 0.5f));
+        py = std::min(height - 1, (int)std::floor(raster_y + 0.5f));
+        
+        std::vector<PathVertex> camera_path, light_path;
+        camera_path.reserve(t);
+        light_path.reserve(s);
+        if (s == 0) {
+            // Camera, depth surface vertices, then the escape
+            Color escaped = generateCameraSubpath(raster_x, raster_y, depth + 1, sampler, camera_path);
+            if ((int)camera_path.size() != depth + 1) return Color();
+            return escaped * (float)strategies;
+        }
+        
+        generateCameraSubpath(raster_x, raster_y, t - 1, sampler, camera_path);
+        if ((int)camera_path.size() != t) return Color();
+        
+        sampler.startStream(kLightStream);
+        generateLightSubpath(s - 1, sampler, light_path);
+        if ((int)light_path.size() != s) return Color();
+        
+        if (s == 1 && t == 1) return Color();
+        int splat_x = px, splat_y = py;
+        Color L = connectBDPT(light_path, camera_path, s, t, splat_x, splat_y);
+        px = splat_x;
+        py = splat_y;
+        return L * (float)strategies;
+    }
+    
+    void renderMetropolis() {
+        beginAccumulation();
+        int depths = bdpt_max_depth + 1;
+        
+        // Bootstrap: luminance of independent paths; sample i has depth i % depths
+        int bootstrap_count = mlt_bootstrap_samples * depths;
+        std::vector<float> bootstrap_weights(bootstrap_count);
+        // Bootstrap path i is a pure function of its stream, so a chain can replay it
+        auto bootstrap_stream = [this](int i) { return RandomStream(i, 0, frame_index, seed ^ 0x4D4C5442u); };
+        parallelFor(bootstrap_count, [&](int i) {
+            MLTSampler sampler(bootstrap_stream(i), kStreamCount);
+            int px, py;
+            bootstrap_weights[i] = luminance(metropolisPath(sampler, i % depths, px, py));
+        });
+        
+        std::vector<float> cdf(bootstrap_count + 1, 0.0f);
+        for (int i = 0; i < bootstrap_count; ++i) cdf[i + 1] = cdf[i] + bootstrap_weights[i];
+        float b = cdf.back() / mlt_bootstrap_samples;
+        
+        // Mutations budget matches samples_per_pixel camera samples per pixel. Accumulated
+        // frames share the average brightness estimate.
+        long long total_mutations = (long long)width * height * samples_per_pixel;
+        long long mutations_per_chain = std::max(1LL, total_mutations / mlt_chains);
+        float mutations_per_pixel = (float)(mutations_per_chain * mlt_chains) / ((float)width * height);
+        accumulated_brightness += b;
+        float scale = accumulated_brightness / ((float)accumulated_frames * accumulated_frames * mutations_per_pixel);
+        if (b <= 0.0f) {
+            resolveAccumulation(scale);
+            return;
+        }
+        
+        parallelFor(mlt_chains, [&](int chain) {
+            RandomStream chain_rng(chain, 0, frame_index, seed ^ 0x4D4C5443u);
+            
+            // Pick a bootstrap path proportionally to its luminance and replay it
+            float target = chain_rng.next() * cdf.back();
+            int index = (int)(std::upper_bound(cdf.begin(), cdf.end(), target) - cdf.begin()) - 1;
+            index = std::max(0, std::min(bootstrap_count - 1, index));
+            int depth = index % depths;
+            MLTSampler sampler(bootstrap_stream(index), kStreamCount);
+            int current_x, current_y;
+            Color current = metropolisPath(sampler, depth, current_x, current_y);
+            
+            for (long long m = 0; m < mutations_per_chain; ++m) {
+                sampler.startIteration();
+                int proposed_x, proposed_y;
+                Color proposed = metropolisPath(sampler, depth, proposed_x, proposed_y);
+                float proposed_lum = luminance(proposed), current_lum = luminance(current);
+                float acceptance = current_lum > 0.0f ? std::min(1.0f, proposed_lum / current_lum) : 1.0f;
+                
+                // Expected-value splats: both states contribute, weighted by acceptance
+                if (acceptance > 0.0f && proposed_lum > 0.0f) {
+                    addToAccumulation(proposed_x, proposed_y, proposed * (acceptance / proposed_lum));
+                }
+                if (current_lum > 0.0f) {
+                    addToAccumulation(current_x, current_y, current * ((1.0f - acceptance) / current_lum));
+                }
+                
+                if (chain_rng.next() < acceptance) {
+                    current = proposed;
+                    current_x = proposed_x;
+                    current_y = proposed_y;
+                    sampler.accept();
+                } else {
+                    sampler.reject();
+                }
+            }
+        });
+        
+        resolveAccumulation(scale);
+    }
+    
+    // Publish a new scene version when the camera or an animated object moved
+    void publishChanges() {
+        ChangeSet changes;
+        std::shared_ptr<const SceneState> latest = scene_store.snapshot();
+        changes.camera_moved = camera_pos != latest->camera_pos;
+        animation.evaluate(time, *latest, renderThreads(), changes);
+        if (!changes.empty()) {
+            scene_store.update([this, &changes](SceneState& next) {
+                next.camera_pos = camera_pos;
+                animation.apply(changes, next);
+                updateBvh(next, changes.moved);
+            });
+        }
+    }
+    
+    void render() {
+        frame_index++;
+        
+        // Update camera position
+        camera_pos = orbitPosition();
+        
+        // Pin the latest scene version for the workers
+        publishChanges();
+        scene = scene_store.snapshot();
+        
+        // Record primary hits while the presenter or the G-buffer view wants them. Stereo
+        // frames have two cameras and Metropolis chains no per-pixel primary ray, so those
+        // frames go without.
+        bool metropolis = quality.refine && engine == RenderEngine::Metropolis;
+        capture_gbuffer = (tracing.load() || gbuffer_view != GBufferView::Off) && stereo == StereoLayout::Off && !metropolis;
+        if (capture_gbuffer) gbuffer.resize(Camera(scene->camera_pos, width, height));
+        else gbuffer.clear();
+        
+        if (stereo != StereoLayout::Off) {
+            renderStereo();
+            return;
+        }
+        
+        if (quality.refine && engine != RenderEngine::Whitted) {
+            if (engine == RenderEngine::PathTrace) renderPathTraced();
+            else if (engine == RenderEngine::Bidirectional) renderBidirectional();
+            else renderMetropolis();
+            return;
+        }
+        
+        if (quality.scale > 1) {
+            renderScaled(quality.scale);
+            return;
+        }
+        
+        if (path_filter_enabled) {
+            clearPathFilter();
+            filtered_pixels.resize(width * height);
+        }
+        
+        // Ray trace each pixel with anti-aliasing
+        Camera camera(scene->camera_pos, width, height);
+        // With the filter on, the second pass overwrites every pixel
+        shadePixels([this, &camera](int x, int y, GBuffer::Hit* primary) {
+            return renderPixel(camera, x, y, path_filter_enabled ? &filtered_pixels[y * width + x] : nullptr, -1, primary);
+        });
+        
+        // Second pass: add the pooled first-hit GI once every sample is in the grid
+        if (path_filter_enabled) {
+            parallelFor(height, [this](int y) {
+                for (int x = 0; x < width; ++x) writePixel(x, y, resolveFiltered(filtered_pixels[y * width + x]));
+            });
+        }
+    }
+    
+    // Whitted preview at 1/scale resolution, upscaled to the window by pixel replication
+    void renderScaled(int scale) {
+        Camera low(scene->camera_pos, (width + scale - 1) / scale, (height + scale - 1) / scale);
+        GBuffer low_gbuffer;
+        std::vector<BatchView> views(1, BatchView{low, {}, capture_gbuffer ? &low_gbuffer : nullptr});
+        renderViews(views);
+        const std::vector<unsigned char>& pixels = views[0].pixels;
+        parallelFor(height, [&](int y) {
+            for (int x = 0; x < width; ++x) {
+                std::copy_n(&pixels[((size_t)(y / scale) * low.width + x / scale) * 3], 3, framePixel(x, y));
+            }
+            if (capture_gbuffer) gbuffer.replicateRow(low_gbuffer, scale, y);
+        });
+    }
+    
+    Vec3 orbitPosition() {
+        std::lock_guard<std::mutex> lock(camera_mutex);
+        return Vec3(camera_distance * sin(camera_angle_x) * cos(camera_angle_y),
+                    camera_distance * sin(camera_angle_y),
+                    camera_distance * cos(camera_angle_x) * cos(camera_angle_y));
+    }
+    
+    // ---- Asynchronous presentation ----
+    
+    // Run an input handler now, or between traced frames while the tracer thread is running
+    void input(std::function<void()> handler) {
+        if (!tracer.joinable()) {
+            handler();
+            return;
+        }
+        std::lock_guard<std::mutex> lock(input_mutex);
+        pending_input.push_back(std::move(handler));
+    }
+    
+    void applyInput() {
+        std::vector<std::function<void()>> handlers;
+        {
+            std::lock_guard<std::mutex> lock(input_mutex);
+            handlers.swap(pending_input);
+        }
+        for (auto& handler : handlers) handler();
+    }
+    
+    // One traced frame: time step, queued edits and input, render, and the periodic stats line
+    void traceFrame(float delta_time) {
+        if (!animation_paused) time += delta_time;
+        applyInput();
+        processConsole();
+        processSceneFiles();
+        
+        int tier = governor.select();
+        quality = governor.tiers[tier];
+        auto start = std::chrono::high_resolution_clock::now();
+        render();
+        if (gbuffer_view != GBufferView::Off && !gbuffer.empty()) showGBuffer();
+        governor.record(tier, std::chrono::duration<float, std::milli>(std::chrono::high_resolution_clock::now() - start).count());
         
-        float t = (-b - sqrt(discriminant)) / (2.0f * a);
-        return t > 0.001f ? t : -1;
+        if (++traced_frames % 60 == 0) {
+            std::cout << "FPS: " << (int)(60.0f / delta_time) << " | Samples: " << samples_per_pixel << "x AA | Time: " << time << "s";
+            if (tile_scheduling) std::cout << " | Thread balance: " << (int)(tile_scheduler.balance * 100) << "%";
+            if (stereo != StereoLayout::Off && engine == RenderEngine::Whitted) {
+                uint64_t lookups = std::max<uint64_t>(1, hit_cache.lookups.load());
+                std::cout << " | Shared hits: " << (int)(100 * hit_cache.reuses.load() / lookups) << "%";
+            }
+            if (governor.enabled) std::cout << " | Quality: " << quality.name;
+            if (tracer.joinable()) std::cout << " | Timewarp";
+            std::cout << " | Memory: " << memoryStats().total() / (1 << 20) << " MB";
+            std::cout << std::endl;
+        }
     }
     
-    Vec3 normal(const Vec3& point) const {
-        return (point - center).normalize();
+    // Replace the image by the gbuffer_view channel
+    void showGBuffer() {
+        parallelFor(height, [this](int y) {
+            std::vector<float> depth(width);
+            std::vector<Vec3> normal(width);
+            std::vector<Color> albedo(width);
+            gbuffer.decodeDepthRow(y, depth.data());
+            if (gbuffer_view == GBufferView::Normal) gbuffer.decodeNormalRow(y, normal.data());
+            if (gbuffer_view == GBufferView::Albedo) gbuffer.decodeAlbedoRow(y, albedo.data());
+            for (int x = 0; x < width; ++x) {
+                Color c;
+                if (gbuffer_view == GBufferView::Normal && depth[x] < INFINITY) {
+                    c = Color(normal[x].x + 1.0f, normal[x].y + 1.0f, normal[x].z + 1.0f) * 0.5f;
+                } else if (gbuffer_view == GBufferView::Depth) {
+                    float shade = 1.0f / (1.0f + 0.2f * depth[x]);
+                    c = Color(shade, shade, shade);
+                } else if (gbuffer_view == GBufferView::Albedo) {
+                    c = albedo[x];
+                } else if (gbuffer_view == GBufferView::Object) {
+                    uint16_t id = gbuffer.object[(size_t)y * width + x];
+                    uint32_t h = pcgHash(id);
+                    if (id) c = Color((h & 255) / 255.0f, (h >> 8 & 255) / 255.0f, (h >> 16 & 255) / 255.0f);
+                }
+                writePixel(x, y, c.clamp());
+            }
+        });
     }
     
-    // Get UV coordinates for texture mapping
-    void getUV(const Vec3& point, float& u, float& v) const {
-        Vec3 n = normal(point);
-        u = 0.5f + atan2(n.z, n.x) / (2 * M_PI);
-        v = 0.5f - asin(n.y) / M_PI;
+    // Hand the frame just rendered to the presenter with the G-buffer render() recorded.
+    // Stereo and Metropolis frames have none and are shown unwarped.
+    void finishFrame() {
+        std::lock_guard<std::mutex> lock(present_mutex);
+        finished.color.resize((size_t)width * height * 3);
+        for (int y = 0; y < height; ++y) std::copy_n(framePixel(0, y), width * 3, &finished.color[(size_t)y * width * 3]);
+        finished.gbuffer.swap(gbuffer);
+        finished.camera = Camera(scene->camera_pos, width, height);
+        finished.fresh = true;
     }
     
-    Color getColor(const Vec3& point) const {
-        if (texture) {
-            float u, v;
-            getUV(point, u, v);
-            return texture->sample(u, v) * color;
+    void traceLoop() {
+        auto last_time = std::chrono::high_resolution_clock::now();
+        while (tracing.load()) {
+            auto current_time = std::chrono::high_resolution_clock::now();
+            traceFrame(std::chrono::duration<float>(current_time - last_time).count());
+            finishFrame();
+            last_time = current_time;
         }
-        return color;
     }
-};
-
-class RealTimeRayTracer {
-private:
-    GLFWwindow* window;
-    std::vector<Sphere> spheres;
-    std::vector<unsigned char> frameBuffer;
-    int width, height;
     
-    // Camera parameters
-    Vec3 camera_pos;
-    Vec3 camera_target;
-    float camera_angle_x, camera_angle_y;
-    float camera_distance;
+    void startTracer() {
+        glfwSwapInterval(1);   // Presentation is paced by vsync
+        {
+            std::lock_guard<std::mutex> lock(present_mutex);
+            finished.fresh = false;
+        }
+        presented = FinishedFrame();
+        warp_current = false;
+        reprojector.threads = presentThreads();
+        tracing.store(true);
+        tracer = std::thread([this] { traceLoop(); });
+    }
     
-    // Animation and random sampling
-    float time;
-    mutable std::mt19937 rng;
-    mutable std::uniform_real_distribution<float> dist;
+    void stopTracer() {
+        if (!tracer.joinable()) return;
+        tracing.store(false);
+        tracer.join();
+        applyInput();
+    }
     
-    // Textures
-    std::unique_ptr<Texture> checkerboard_texture;
+    // Show the latest finished frame, reprojected if the camera moved since it was traced
+    void present() {
+        {
+            std::lock_guard<std::mutex> lock(present_mutex);
+            if (finished.fresh) {
+                std::swap(presented, finished);
+                finished.fresh = false;
+                warp_current = false;
+            }
+        }
+        if (presented.color.empty()) return;
+        
+        const Camera& traced = presented.camera;
+        Camera current(orbitPosition(), traced.width, traced.height);
+        const unsigned char* pixels = presented.color.data();
+        if (!presented.gbuffer.empty() && current.position != traced.position) {
+            // Between frames the camera often holds still for several vsyncs
+            if (!warp_current || current.position != warped_to) {
+                reprojector.warp(presented.color, presented.gbuffer, current);
+                warp_current = true;
+                warped_to = current.position;
+            }
+            pixels = reprojector.color.data();
+        }
+        glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+        glDrawPixels(traced.width, traced.height, GL_RGB, GL_UNSIGNED_BYTE, pixels);
+    }
     
-    // Anti-aliasing samples per pixel
-    int samples_per_pixel;
+    // ---- Batch rendering ----
+    //
+    // Several views of one scene version in one pass. The views are stacked on a virtual
+    // canvas, each starting on a tile row, so a single scheduler run balances the tiles of
+    // all views together; the BVH, textures, path-space filter grid and workers are shared.
+    // With the Whitted engine the first view gets a run of its own that fills hit_cache, and
+    // the others reuse its primary-hit shadow and GI results.
+    // The bidirectional and Metropolis engines splat through the interactive camera, so
+    // batches render with path tracing unless the Whitted engine is selected.
     
-public:
-    RealTimeRayTracer(int w, int h) : width(w), height(h), 
-        camera_pos(0, 0, 5), camera_target(0, 0, 0), 
-        camera_angle_x(0), camera_angle_y(0), camera_distance(5), time(0),
-        rng(std::random_device{}()), dist(0.0f, 1.0f), samples_per_pixel(2) {
+    struct BatchView {
+        Camera camera;
+        std::vector<unsigned char> pixels;   // RGB, top row first
+        GBuffer* gbuffer = nullptr;          // When set, resized to camera and given the primary hits
+    };
+    
+    void renderViews(std::vector<BatchView>& views) {
+        if (views.empty()) return;
+        frame_index++;
+        scene = scene_store.snapshot();
         
-        // Initialize GLFW
-        if (!glfwInit()) {
-            std::cerr << "Failed to initialize GLFW" << std::endl;
-            exit(-1);
+        std::vector<int> offsets;   // Canvas row of each view's first row
+        int canvas_width = 0, canvas_height = 0;
+        for (auto& view : views) {
+            view.pixels.assign((size_t)view.camera.width * view.camera.height * 3, 0);
+            if (view.gbuffer) view.gbuffer->resize(view.camera);
+            offsets.push_back(canvas_height);
+            canvas_width = std::max(canvas_width, view.camera.width);
+            canvas_height += (view.camera.height + batch_scheduler.base_size - 1) / batch_scheduler.base_size * batch_scheduler.base_size;
         }
         
-        // Create window
-        window = glfwCreateWindow(width, height, "Real-Time Ray Tracer", nullptr, nullptr);
-        if (!window) {
-            glfwTerminate();
-            exit(-1);
+        bool whitted = engine == RenderEngine::Whitted || !quality.refine;
+        bool filter = whitted && path_filter_enabled;
+        bool share = whitted && views.size() > 1;
+        if (share) clearHitCache();
+        std::vector<std::vector<FilteredPixel>> filtered(views.size());
+        if (filter) {
+            clearPathFilter();
+            for (size_t i = 0; i < views.size(); ++i) filtered[i].resize((size_t)views[i].camera.width * views[i].camera.height);
         }
         
-        glfwMakeContextCurrent(window);
-        glfwSetWindowUserPointer(window, this);
-        
-        // Get actual framebuffer size (important for Retina displays)
-        int fb_width, fb_height;
-        glfwGetFramebufferSize(window, &fb_width, &fb_height);
-        width = fb_width;
-        height = fb_height;
-        
-        frameBuffer.resize(width * height * 3);
-        
-        // Set callbacks
-        glfwSetKeyCallback(window, keyCallback);
-        glfwSetCursorPosCallback(window, mouseCallback);
-        glfwSetScrollCallback(window, scrollCallback);
-        glfwSetFramebufferSizeCallback(window, framebufferSizeCallback);
-        
-        // Initialize OpenGL
-        if (glewInit() != GLEW_OK) {
-            std::cerr << "Failed to initialize GLEW" << std::endl;
-            exit(-1);
+        // Colour of canvas pixel (x, y); with the filter on, the resolve below overwrites it
+        auto shade = [&](int x, int y, GBuffer::Hit* primary) {
+            int index = (int)(std::upper_bound(offsets.begin(), offsets.end(), y) - offsets.begin()) - 1;
+            BatchView& view = views[index];
+            y -= offsets[index];
+            if (x >= view.camera.width || y >= view.camera.height) return Color();
+            size_t pixel = (size_t)y * view.camera.width + x;
+            if (whitted) return renderPixel(view.camera, x, y, filter ? &filtered[index][pixel] : nullptr, share ? index : -1, primary);
+            return renderPixelPathTraced(view.camera, x, y, primary).clamp();
+        };
+        bool capture = false;
+        for (auto& view : views) capture = capture || view.gbuffer;
+        auto pass = [&](TileScheduler& scheduler, int first_row, int rows) {
+            scheduler.run(canvas_width, rows, renderThreads(), [&](const Tile& tile) {
+                // Staged like shadePixels does, so neighbouring tiles share no cache lines
+                int tile_width = tile.x1 - tile.x0;
+                GBuffer::Row hits(capture ? tile_width * (tile.y1 - tile.y0) : 0);
+                AlignedVector<unsigned char, MemoryTag::Frame> rgb((size_t)tile_width * (tile.y1 - tile.y0) * 3);
+                scheduler.forEachPixel(tile, [&](int x, int y) {
+                    int i = (y - tile.y0) * tile_width + x - tile.x0;
+                    auto stage = [&](int x, int y, GBuffer::Hit* primary) { encodePixel(&rgb[(size_t)i * 3], shade(x, y, primary)); };
+                    visitPixel(stage, x, first_row + y, hits, i);
+                });
+                // Tile pixels past a view's edge were staged as blanks and misses and are dropped here
+                for (int y = tile.y0; y < tile.y1; ++y) {
+                    int canvas_y = first_row + y;
+                    int index = (int)(std::upper_bound(offsets.begin(), offsets.end(), canvas_y) - offsets.begin()) - 1;
+                    BatchView& view = views[index];
+                    int view_y = canvas_y - offsets[index];
+                    int count = std::min(tile.x1, view.camera.width) - tile.x0;
+                    if (view_y >= view.camera.height || count <= 0) continue;
+                    int first = (y - tile.y0) * tile_width;
+                    std::copy_n(&rgb[(size_t)first * 3], count * 3, &view.pixels[((size_t)view_y * view.camera.width + tile.x0) * 3]);
+                    if (view.gbuffer) view.gbuffer->encodeSpan(view_y, tile.x0, hits, first, count);
+                }
+            });
+        };
+        if (share) {
+            // The first view fills the hit-point cache before the others read it. The passes
+            // cost very differently per pixel, so each keeps its own cost history.
+            pass(batch_scheduler, 0, offsets[1]);
+            pass(reuse_scheduler, offsets[1], canvas_height - offsets[1]);
+        } else {
+            pass(batch_scheduler, 0, canvas_height);
         }
         
-        glViewport(0, 0, width, height);
-        glDisable(GL_DEPTH_TEST);
+        if (filter) {
+            for (size_t i = 0; i < views.size(); ++i) {
+                parallelFor((int)filtered[i].size(), [&](int pixel) {
+                    encodePixel(&views[i].pixels[(size_t)pixel * 3], resolveFiltered(filtered[i][pixel]));
+                });
+            }
+        }
+    }
+    
+    // Stereo pair around the interactive camera: parallel eye axes offset along its right
+    // vector, rendered as one two-view batch. Side by side, each eye gets half the window;
+    // layered, both eyes are full size in stereo_layers and the window shows an anaglyph.
+    void renderStereo() {
+        int eye_width = stereo == StereoLayout::SideBySide ? width / 2 : width;
+        Camera center(scene->camera_pos, eye_width, height);
+        std::vector<BatchView> views(2, BatchView{center, {}});
+        views[0].camera.position = center.position - center.right * (eye_separation * 0.5f);
+        views[1].camera.position = center.position + center.right * (eye_separation * 0.5f);
+        renderViews(views);
         
-        // Create textures
-        checkerboard_texture = std::make_unique<Texture>(64, 64);
+        size_t eye_row = (size_t)eye_width * 3;
+        if (stereo == StereoLayout::SideBySide) {
+            std::fill(frameBuffer.begin(), frameBuffer.end(), 0);
+            for (int eye = 0; eye < 2; ++eye) {
+                for (int y = 0; y < height; ++y) {
+                    std::copy_n(&views[eye].pixels[y * eye_row], eye_row, framePixel(eye * eye_width, y));
+                }
+            }
+            return;
+        }
         
-        // Create scene
-        createScene();
+        size_t layer_size = (size_t)width * height * 3;
+        stereo_layers.resize(layer_size * 2);
+        std::copy(views[0].pixels.begin(), views[0].pixels.end(), stereo_layers.begin());
+        std::copy(views[1].pixels.begin(), views[1].pixels.end(), stereo_layers.begin() + layer_size);
+        for (int y = 0; y < height; ++y) {
+            for (int x = 0; x < width; ++x) {
+                size_t i = ((size_t)y * width + x) * 3;
+                unsigned char* rgb = framePixel(x, y);
+                rgb[0] = stereo_layers[i];
+                rgb[1] = stereo_layers[layer_size + i + 1];
+                rgb[2] = stereo_layers[layer_size + i + 2];
+            }
+        }
     }
     
-    void createScene() {
-        spheres.clear();
-        
-        // Add spheres with different materials and textures
-        spheres.push_back(Sphere(Vec3(-2, 0, -5), 1.0f, Color(0.8f, 0.2f, 0.2f), 0.9f, 0.0f, 1.0f)); // Red metallic
-        spheres.push_back(Sphere(Vec3(0, 0, -5), 1.0f, Color(0.9f, 0.9f, 0.9f), 0.0f, 0.9f, 1.52f));   // Glass
-        spheres.push_back(Sphere(Vec3(2, 0, -5), 1.0f, Color(0.2f, 0.2f, 0.8f), 0.0f, 0.0f, 1.0f));    // Blue diffuse
-        spheres.push_back(Sphere(Vec3(0, -101, -5), 100.0f, Color(1.0f, 1.0f, 1.0f), 0.0f, 0.0f, 1.0f, checkerboard_texture.get())); // Textured ground
+    // ---- Auto-tuning ----
+    
+    void applyTuning(const TuningConfig& config) {
+        tuning = config;
+        tile_scheduler.base_size = batch_scheduler.base_size = reuse_scheduler.base_size = config.tile_size;
+        tile_scheduler.order = batch_scheduler.order = reuse_scheduler.order = config.order;
+        if (!threads_fixed) thread_count = config.threads > 0 ? config.threads : std::max(1u, std::thread::hardware_concurrency());
+        if (bvh_traversal != config.traversal) {
+            bvh_traversal = config.traversal;
+            scene_store.update([this](SceneState& next) { next.editBvh().traversal = bvh_traversal; });
+        }
     }
     
-    // Sample hemisphere for global illumination
-    Vec3 sampleHemisphere(const Vec3& normal) const {
-        float r1 = dist(rng);
-        float r2 = dist(rng);
-        
-        float cos_theta = sqrt(r1);
-        float sin_theta = sqrt(1.0f - r1);
-        float phi = 2 * M_PI * r2;
-        
-        Vec3 w = normal;
-        Vec3 u = ((abs(w.x) > 0.1f) ? Vec3(0, 1, 0) : Vec3(1, 0, 0)).cross(w).normalize();
-        Vec3 v = w.cross(u);
-        
-        return u * cos(phi) * sin_theta + v * sin(phi) * sin_theta + w * cos_theta;
+    static std::string describeTuning(const TuningConfig& config) {
+        std::ostringstream out;
+        out << "tiles " << config.tile_size << ", " << (config.threads > 0 ? std::to_string(config.threads) : "all")
+            << " threads, " << pixelOrderName(config.order) << " order, " << bvhTraversalName(config.traversal)
+            << " traversal, packets of " << config.packet_width;
+        return out.str();
     }
     
-    // Fresnel reflectance calculation
-    float fresnel(float cos_i, float eta) const {
-        float sin_t = eta * sqrt(std::max(0.0f, 1.0f - cos_i * cos_i));
-        if (sin_t >= 1.0f) return 1.0f; // Total internal reflection
-        
-        float cos_t = sqrt(std::max(0.0f, 1.0f - sin_t * sin_t));
-        float r_perp = (eta * cos_i - cos_t) / (eta * cos_i + cos_t);
-        float r_parallel = (cos_i - eta * cos_t) / (cos_i + eta * cos_t);
-        
-        return (r_perp * r_perp + r_parallel * r_parallel) * 0.5f;
+    std::string tuningClass() const {
+        return TuningFile::sceneClass(scene_store.snapshot()->spheres().size());
     }
     
-    Color trace(const Ray& ray, int depth = 0) const {
-        if (depth > 8) return Color(0.1f, 0.1f, 0.2f); // Sky color
-        
-        float closest_t = 1e30f;
-        const Sphere* hit_sphere = nullptr;
-        
-        // Find closest intersection
-        for (const auto& sphere : spheres) {
-            float t = sphere.intersect(ray);
-            if (t > 0 && t < closest_t) {
-                closest_t = t;
-                hit_sphere = &sphere;
-            }
+    void loadTuning() {
+        TuningConfig config;
+        if (!tuning_file.load(TuningFile::hostName(), tuningClass(), config)) return;
+        applyTuning(config);
+        std::cout << "Tuning for " << TuningFile::hostName() << " / " << tuningClass() << ": " << describeTuning(config) << std::endl;
+    }
+    
+    // Best of two timed full-quality Whitted frames after one that settles the scheduler's
+    // cost history
+    double tuningFrameMs(const TuningConfig& config) {
+        applyTuning(config);
+        double best = 1e30;
+        for (int i = 0; i < 3; ++i) {
+            auto start = std::chrono::high_resolution_clock::now();
+            render();
+            double ms = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+            if (i > 0) best = std::min(best, ms);
         }
-        
-        if (!hit_sphere) return Color(0.1f, 0.1f, 0.2f); // Sky
-        
-        Vec3 hit_point = ray.at(closest_t);
-        Vec3 normal = hit_sphere->normal(hit_point);
-        Color material_color = hit_sphere->getColor(hit_point);
-        
-        // Basic lighting
-        Vec3 light_pos(sin(time) * 3, 2, cos(time) * 3 - 3);
-        Vec3 light_dir = (light_pos - hit_point).normalize();
-        
-        // Shadow test
-        Ray shadow_ray(hit_point + normal * 0.001f, light_dir);
-        bool in_shadow = false;
-        for (const auto& sphere : spheres) {
-            if (&sphere != hit_sphere && sphere.intersect(shadow_ray) > 0) {
-                in_shadow = true;
-                break;
+        return best;
+    }
+    
+    // Primary rays of the current view and one diffuse bounce from each hit
+    RayBatch tuningRays() const {
+        Camera camera(scene_store.snapshot()->camera_pos, 256, 192);
+        RayBatch primary, rays;
+        for (int y = 0; y < camera.height; ++y) {
+            for (int x = 0; x < camera.width; ++x) {
+                Ray ray = camera.ray((float)x, (float)y);
+                primary.push(ray.origin, ray.direction);
             }
         }
+        SurfaceBatch hits;
+        query().closestHit(primary, hits);
+        std::mt19937 rng(11);
+        std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+        rays = primary;
+        for (size_t i = 0; i < hits.prim.size(); ++i) {
+            if (hits.prim[i] < 0) continue;
+            Vec3 n(hits.normal_x[i], hits.normal_y[i], hits.normal_z[i]);
+            Vec3 p(hits.position_x[i], hits.position_y[i], hits.position_z[i]);
+            float r1 = unit(rng), r2 = unit(rng);
+            rays.push(p + n * 0.001f, cosineHemisphere(n, r1, r2));
+        }
+        return rays;
+    }
+    
+    // Coordinate descent over the tuning grid: each setting in turn is swept with the others
+    // held at their best so far, on short full-quality Whitted renders of the current scene
+    // at the current resolution. Packet width is timed on batched closest-hit queries. A
+    // candidate must win by 2% to replace the incumbent, so timing noise does not churn
+    // the saved settings. The result is applied and saved for this host and scene class.
+    void autoTune() {
+        std::cout << "Tuning " << width << "x" << height << " for " << TuningFile::hostName() << " / " << tuningClass() << "..." << std::endl;
+        RenderEngine saved_engine = engine;
+        QualityTier saved_quality = quality;
+        engine = RenderEngine::Whitted;
+        quality = governor.tiers.back();
         
-        float light_intensity = in_shadow ? 0.1f : std::max(0.1f, normal.dot(light_dir));
-        Color final_color = material_color * light_intensity;
+        TuningConfig best = tuning;
+        double best_ms = tuningFrameMs(best);
+        std::cout << "  " << describeTuning(best) << ": " << best_ms << " ms" << std::endl;
+        auto consider = [&](const TuningConfig& candidate) {
+            double ms = tuningFrameMs(candidate);
+            std::cout << "  " << describeTuning(candidate) << ": " << ms << " ms" << std::endl;
+            if (ms < best_ms * 0.98) {
+                best = candidate;
+                best_ms = ms;
+            }
+        };
         
-        // Handle reflections
-        if (hit_sphere->metallic > 0.0f) {
-            Vec3 reflect_dir = ray.direction.reflect(normal);
-            Ray reflect_ray(hit_point + normal * 0.001f, reflect_dir);
-            Color reflect_color = trace(reflect_ray, depth + 1);
-            final_color = final_color * (1.0f - hit_sphere->metallic) + reflect_color * hit_sphere->metallic;
+        for (int size : {16, 32, 64}) {
+            TuningConfig candidate = best;
+            candidate.tile_size = size;
+            if (size != best.tile_size) consider(candidate);
         }
-        
-        // Handle transparency and refraction
-        if (hit_sphere->transparency > 0.0f) {
-            Vec3 view_dir = ray.direction * -1.0f;
-            float cos_i = view_dir.dot(normal);
-            float eta = cos_i > 0 ? 1.0f / hit_sphere->refractive_index : hit_sphere->refractive_index;
-            Vec3 refract_normal = cos_i > 0 ? normal : normal * -1.0f;
-            
-            Vec3 refract_dir = ray.direction.refract(refract_normal, eta);
-            if (refract_dir.x != 0 || refract_dir.y != 0 || refract_dir.z != 0) {
-                Ray refract_ray(hit_point - refract_normal * 0.001f, refract_dir);
-                Color refract_color = trace(refract_ray, depth + 1);
-                
-                // Fresnel blend
-                float fresnel_factor = fresnel(abs(cos_i), eta);
-                Vec3 reflect_dir = ray.direction.reflect(normal);
-                Ray reflect_ray(hit_point + normal * 0.001f, reflect_dir);
-                Color reflect_color = trace(reflect_ray, depth + 1);
-                
-                Color transparent_color = reflect_color * fresnel_factor + refract_color * (1.0f - fresnel_factor);
-                final_color = final_color * (1.0f - hit_sphere->transparency) + transparent_color * hit_sphere->transparency;
+        if (!threads_fixed) {
+            int hardware = (int)std::max(1u, std::thread::hardware_concurrency());
+            std::vector<int> counts = {0, hardware * 2};   // 0: one per hardware thread
+            if (hardware > 1) counts.push_back(hardware / 2);
+            for (int threads : counts) {
+                TuningConfig candidate = best;
+                candidate.threads = threads;
+                if (threads != best.threads) consider(candidate);
             }
         }
+        for (PixelOrder order : {PixelOrder::Scanline, PixelOrder::Morton, PixelOrder::Hilbert}) {
+            TuningConfig candidate = best;
+            candidate.order = order;
+            if (order != best.order) consider(candidate);
+        }
+        for (BvhTraversal traversal : {BvhTraversal::Stack, BvhTraversal::ShortStack, BvhTraversal::Stackless}) {
+            TuningConfig candidate = best;
+            candidate.traversal = traversal;
+            if (traversal != best.traversal) consider(candidate);
+        }
+        applyTuning(best);
         
-        // Global illumination
-        if (depth < 3 && hit_sphere->metallic < 0.5f) {
-            Vec3 random_dir = sampleHemisphere(normal);
-            Ray gi_ray(hit_point + normal * 0.001f, random_dir);
-            Color gi_color = trace(gi_ray, depth + 1);
-            final_color = final_color + gi_color * material_color * 0.1f;
+        RayBatch rays = tuningRays();
+        SceneQuery batch_query = query();
+        SurfaceBatch hits;
+        double best_query_ms = 1e30;
+        for (int packet_width : {best.packet_width, 1, 2, 4, 8}) {
+            batch_query.packet_width = packet_width;
+            double ms = 1e30;
+            for (int i = 0; i < 3; ++i) {
+                auto start = std::chrono::high_resolution_clock::now();
+                batch_query.closestHit(rays, hits);
+                ms = std::min(ms, std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count());
+            }
+            if (ms < best_query_ms * 0.98) {
+                best.packet_width = packet_width;
+                best_query_ms = ms;
+            }
         }
+        std::cout << "  closest-hit queries: packets of " << best.packet_width << ", " << best_query_ms << " ms for " << rays.size() << " rays" << std::endl;
         
-        return final_color.clamp();
+        applyTuning(best);
+        engine = saved_engine;
+        quality = saved_quality;
+        if (!tuning_file.save(TuningFile::hostName(), tuningClass(), best)) std::cerr << "Cannot write " << tuning_file.path << std::endl;
+        std::cout << "Tuned: " << describeTuning(best) << " (" << best_ms << " ms per frame)" << std::endl;
     }
     
-    void render() {
-        // Update camera position
-        camera_pos.x = camera_distance * sin(camera_angle_x) * cos(camera_angle_y);
-        camera_pos.y = camera_distance * sin(camera_angle_y);
-        camera_pos.z = camera_distance * cos(camera_angle_x) * cos(camera_angle_y);
+    // Product-shot orbit: count views around the feature spheres, written to
+    // thumbnail_NNN.ppm in the working directory
+    void renderThumbnails(int count, int view_width, int view_height, int samples) {
+        const Vec3 target(0, 0, -5);
+        const float elevation = 0.3f;
+        std::vector<BatchView> views(count);
+        for (int i = 0; i < count; ++i) {
+            float angle = 2.0f * (float)M_PI * i / count;
+            Vec3 offset(sin(angle) * cos(elevation), sin(elevation), cos(angle) * cos(elevation));
+            views[i].camera = Camera::lookAt(target + offset * camera_distance, target, view_width, view_height);
+        }
         
-        // Animate spheres
-        spheres[0].center.y = sin(time * 2) * 0.5f;
-        spheres[1].center.x = sin(time) * 0.5f;
-        spheres[2].center.z = -5 + sin(time * 1.5f) * 0.3f;
+        engine = RenderEngine::PathTrace;
+        samples_per_pixel = samples;
+        publishChanges();
+        auto start = std::chrono::high_resolution_clock::now();
+        renderViews(views);
+        double ms = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
         
-        // Ray trace each pixel with anti-aliasing
-        for (int y = 0; y < height; ++y) {
-            for (int x = 0; x < width; ++x) {
-                Color pixel_color;
-                
-                // Anti-aliasing: multiple samples per pixel
-                for (int sample = 0; sample < samples_per_pixel; ++sample) {
-                    // Random jitter for anti-aliasing
-                    float jitter_x = dist(rng) - 0.5f;
-                    float jitter_y = dist(rng) - 0.5f;
-                    
-                    float u = ((x + jitter_x) / (float)width) * 2.0f - 1.0f;
-                    float v = ((y + jitter_y) / (float)height) * 2.0f - 1.0f;
-                    v *= (float)height / width; 
-                    
-                    Vec3 ray_dir = Vec3(u, -v, -1).normalize();
-                    Ray ray(camera_pos, ray_dir);
-                    
-                    pixel_color = pixel_color + trace(ray);
-                }
-                
-                // Average the samples
-                pixel_color = pixel_color * (1.0f / samples_per_pixel);
-                
-                int index = (y * width + x) * 3;
-                frameBuffer[index] = (unsigned char)(pixel_color.r * 255);
-                frameBuffer[index + 1] = (unsigned char)(pixel_color.g * 255);
-                frameBuffer[index + 2] = (unsigned char)(pixel_color.b * 255);
-            }
+        for (int i = 0; i < count; ++i) {
+            char name[32];
+            snprintf(name, sizeof(name), "thumbnail_%03d.ppm", i);
+            if (!writePPM(name, view_width, view_height, views[i].pixels)) std::cerr << "Cannot write " << name << std::endl;
         }
-        
-        // Display the frame buffer
-        glDrawPixels(width, height, GL_RGB, GL_UNSIGNED_BYTE, frameBuffer.data());
+        std::cout << "Rendered " << count << " views of " << view_width << "x" << view_height << " at " << samples
+                  << " spp in " << ms << " ms (" << thread_count << " threads, thread balance "
+                  << (int)(batch_scheduler.balance * 100) << "%)" << std::endl;
     }
     
     void run() {
         auto last_time = std::chrono::high_resolution_clock::now();
-        int frame_count = 0;
         
         std::cout << "Real-Time Ray Tracer Started!" << std::endl;
         std::cout << "Features: Reflections, Refractions, Anti-aliasing, Texture Mapping, Global Illumination" << std::endl;
@@ -376,38 +5905,70 @@ public:
         std::cout << "- Scroll: Zoom in/out" << std::endl;
         std::cout << "- WASD: Move camera" << std::endl;
         std::cout << "- Q/E: Adjust anti-aliasing quality" << std::endl;
+        std::cout << "- L: Toggle level of detail" << std::endl;
+        std::cout << "- F: Toggle path-space filtering" << std::endl;
+        std::cout << "- R: Toggle stochastic / branching glass in the Whitted engine" << std::endl;
+        std::cout << "- 1/2/3/4: Whitted / bidirectional / Metropolis / path tracing engine" << std::endl;
+        std::cout << "- B: Cycle BVH build preset (LBVH / binned SAH / SAH + treelets)" << std::endl;
+        std::cout << "- T: Cycle BVH traversal kernel (stack / short stack / stackless)" << std::endl;
+        std::cout << "- G: Toggle cost-predictive tile scheduling / static row bands" << std::endl;
+        std::cout << "- O: Cycle tile and pixel order (scanline / Morton / Hilbert)" << std::endl;
+        std::cout << "- P: Pause / resume animation" << std::endl;
+        std::cout << "- V: Cycle stereo output (off / side by side / layered anaglyph)" << std::endl;
+        std::cout << "- U: Re-tune tiles, threads, pixel order, traversal and packet width for this machine" << std::endl;
+        std::cout << "- I: Toggle the quality governor (cheap previews while the camera moves)" << std::endl;
+        std::cout << "- Z: Toggle timewarp (trace on a separate thread, reproject at every vsync)" << std::endl;
+        std::cout << "- M: Print memory use per subsystem" << std::endl;
+        std::cout << "- N: Cycle G-buffer view (off / normal / depth / albedo / object id)" << std::endl;
         std::cout << "- ESC: Exit" << std::endl;
         
+        if (console) std::cout << "Console: type 'help' for scene editing commands" << std::endl;
+        
         while (!glfwWindowShouldClose(window)) {
-            auto current_time = std::chrono::high_resolution_clock::now();
-            float delta_time = std::chrono::duration<float>(current_time - last_time).count();
-            time += delta_time;
+            if (timewarp != tracer.joinable()) {
+                if (timewarp) {
+                    startTracer();
+                } else {
+                    stopTracer();
+                    last_time = std::chrono::high_resolution_clock::now();
+                }
+            }
             
             glClear(GL_COLOR_BUFFER_BIT);
             
-            render();
+            // The tracer thread renders; this thread only presents, once per vsync
+            if (tracer.joinable()) {
+                present();
+                glfwSwapBuffers(window);
+                glfwPollEvents();
+                continue;
+            }
+            
+            auto current_time = std::chrono::high_resolution_clock::now();
+            traceFrame(std::chrono::duration<float>(current_time - last_time).count());
+            glPixelStorei(GL_UNPACK_ROW_LENGTH, frame_row_length);
+            glDrawPixels(width, height, GL_RGB, GL_UNSIGNED_BYTE, frameBuffer.data());
             
             glfwSwapBuffers(window);
             glfwPollEvents();
             
-            frame_count++;
-            if (frame_count % 60 == 0) {
-                std::cout << "FPS: " << (int)(60.0f / delta_time) << " | Samples: " << samples_per_pixel << "x AA | Time: " << time << "s" << std::endl;
-            }
-            
             last_time = current_time;
             
             // Cap framerate
             std::this_thread::sleep_for(std::chrono::milliseconds(16));
         }
+        stopTracer();
     }
     
     ~RealTimeRayTracer() {
+        stopTracer();
+        if (!window) return;
         glfwDestroyWindow(window);
         glfwTerminate();
     }
     
-    // Input callbacks
+    // Input callbacks. Camera motion applies at once, so a presenting main thread shows it
+    // at the next vsync; other keys go through input() and may wait for the traced frame.
     static void keyCallback(GLFWwindow* window, int key, int scancode, int action, int mods) {
         RealTimeRayTracer* app = static_cast<RealTimeRayTracer*>(glfwGetWindowUserPointer(window));
         
@@ -415,22 +5976,131 @@ public:
             glfwSetWindowShouldClose(window, GLFW_TRUE);
         }
         
-        if (action == GLFW_PRESS || action == GLFW_REPEAT) {
+        if (action != GLFW_PRESS && action != GLFW_REPEAT) return;
+        {
+            std::lock_guard<std::mutex> lock(app->camera_mutex);
             switch (key) {
-                case GLFW_KEY_W: app->camera_angle_y += 0.1f; break;
-                case GLFW_KEY_S: app->camera_angle_y -= 0.1f; break;
-                case GLFW_KEY_A: app->camera_angle_x -= 0.1f; break;
-                case GLFW_KEY_D: app->camera_angle_x += 0.1f; break;
-                case GLFW_KEY_Q: 
-                    app->samples_per_pixel = std::max(1, app->samples_per_pixel - 1);
-                    std::cout << "Anti-aliasing: " << app->samples_per_pixel << "x" << std::endl;
-                    break;
-                case GLFW_KEY_E: 
-                    app->samples_per_pixel = std::min(8, app->samples_per_pixel + 1);
-                    std::cout << "Anti-aliasing: " << app->samples_per_pixel << "x" << std::endl;
-                    break;
+                case GLFW_KEY_W: app->camera_angle_y += 0.1f; app->governor.onInput(); return;
+                case GLFW_KEY_S: app->camera_angle_y -= 0.1f; app->governor.onInput(); return;
+                case GLFW_KEY_A: app->camera_angle_x -= 0.1f; app->governor.onInput(); return;
+                case GLFW_KEY_D: app->camera_angle_x += 0.1f; app->governor.onInput(); return;
             }
         }
+        if (key == GLFW_KEY_Z && action == GLFW_PRESS) {
+            app->timewarp = !app->timewarp;
+            std::cout << "Timewarp: " << (app->timewarp ? "on" : "off") << std::endl;
+            return;
+        }
+        app->input([app, key, action] { app->handleKey(key, action); });
+    }
+    
+    void handleKey(int key, int action) {
+        switch (key) {
+            case GLFW_KEY_Q: 
+                samples_per_pixel = std::max(1, samples_per_pixel - 1);
+                std::cout << "Anti-aliasing: " << samples_per_pixel << "x" << std::endl;
+                break;
+            case GLFW_KEY_E: 
+                samples_per_pixel = std::min(8, samples_per_pixel + 1);
+                std::cout << "Anti-aliasing: " << samples_per_pixel << "x" << std::endl;
+                break;
+            case GLFW_KEY_L:
+                if (action == GLFW_PRESS) {
+                    lod_enabled = !lod_enabled;
+                    std::cout << "Level of detail: " << (lod_enabled ? "on" : "off") << std::endl;
+                }
+                break;
+            case GLFW_KEY_F:
+                if (action == GLFW_PRESS) {
+                    path_filter_enabled = !path_filter_enabled;
+                    std::cout << "Path-space filtering: " << (path_filter_enabled ? "on" : "off") << std::endl;
+                }
+                break;
+            case GLFW_KEY_R:
+                if (action == GLFW_PRESS) {
+                    stochastic_dielectric = !stochastic_dielectric;
+                    std::cout << "Glass: " << (stochastic_dielectric ? "stochastic Fresnel branch" : "reflect + refract") << std::endl;
+                }
+                break;
+            case GLFW_KEY_B:
+                if (action == GLFW_PRESS) {
+                    bvh_preset = bvh_preset == BvhPreset::Fast ? BvhPreset::Balanced
+                               : bvh_preset == BvhPreset::Balanced ? BvhPreset::HighQuality : BvhPreset::Fast;
+                    scene_store.update([this](SceneState& next) { rebuildBvh(next); });
+                    std::cout << "BVH: " << bvhPresetName(bvh_preset) << " | " << scene_store.snapshot()->spheres().size() << " spheres | "
+                              << bvh_stats.build_ms << " ms | SAH cost " << bvh_stats.sah_cost
+                              << " | " << bvh_stats.nodes << " nodes" << std::endl;
+                }
+                break;
+            case GLFW_KEY_T:
+                if (action == GLFW_PRESS) {
+                    bvh_traversal = bvh_traversal == BvhTraversal::Stack ? BvhTraversal::ShortStack
+                                  : bvh_traversal == BvhTraversal::ShortStack ? BvhTraversal::Stackless : BvhTraversal::Stack;
+                    scene_store.update([this](SceneState& next) { next.editBvh().traversal = bvh_traversal; });
+                    std::cout << "BVH traversal: " << bvhTraversalName(bvh_traversal) << std::endl;
+                }
+                break;
+            case GLFW_KEY_G:
+                if (action == GLFW_PRESS) {
+                    tile_scheduling = !tile_scheduling;
+                    std::cout << "Scheduling: " << (tile_scheduling ? "cost-predictive tiles" : "static row bands") << std::endl;
+                }
+                break;
+            case GLFW_KEY_O:
+                if (action == GLFW_PRESS) {
+                    PixelOrder& order = tile_scheduler.order;
+                    order = order == PixelOrder::Scanline ? PixelOrder::Morton
+                          : order == PixelOrder::Morton ? PixelOrder::Hilbert : PixelOrder::Scanline;
+                    std::cout << "Pixel order: " << pixelOrderName(order) << std::endl;
+                }
+                break;
+            case GLFW_KEY_P:
+                if (action == GLFW_PRESS) {
+                    animation_paused = !animation_paused;
+                    std::cout << "Animation: " << (animation_paused ? "paused" : "running") << std::endl;
+                }
+                break;
+            case GLFW_KEY_I:
+                if (action == GLFW_PRESS) {
+                    governor.enabled = !governor.enabled;
+                    std::cout << "Quality governor: " << (governor.enabled ? "on" : "off") << std::endl;
+                }
+                break;
+            case GLFW_KEY_U:
+                if (action == GLFW_PRESS) autoTune();
+                break;
+            case GLFW_KEY_M:
+                if (action == GLFW_PRESS) std::cout << "Memory:\n" << memoryStats().report() << std::endl;
+                break;
+            case GLFW_KEY_N:
+                if (action == GLFW_PRESS) {
+                    gbuffer_view = (GBufferView)(((int)gbuffer_view + 1) % 5);
+                    std::cout << "G-buffer view: " << gbufferViewName(gbuffer_view) << std::endl;
+                }
+                break;
+            case GLFW_KEY_V:
+                if (action == GLFW_PRESS) {
+                    stereo = (StereoLayout)(((int)stereo + 1) % 3);
+                    std::cout << "Stereo: " << stereoLayoutName(stereo) << std::endl;
+                }
+                break;
+            case GLFW_KEY_1:
+                engine = RenderEngine::Whitted;
+                std::cout << "Engine: Whitted" << std::endl;
+                break;
+            case GLFW_KEY_2:
+                engine = RenderEngine::Bidirectional;
+                std::cout << "Engine: bidirectional path tracing" << std::endl;
+                break;
+            case GLFW_KEY_3:
+                engine = RenderEngine::Metropolis;
+                std::cout << "Engine: Metropolis light transport" << std::endl;
+                break;
+            case GLFW_KEY_4:
+                engine = RenderEngine::PathTrace;
+                std::cout << "Engine: path tracing" << std::endl;
+                break;
+        }
     }
     
     static void mouseCallback(GLFWwindow* window, double xpos, double ypos) {
@@ -438,8 +6108,10 @@ public:
         RealTimeRayTracer* app = static_cast<RealTimeRayTracer*>(glfwGetWindowUserPointer(window));
         
         if (glfwGetMouseButton(window, GLFW_MOUSE_BUTTON_LEFT) == GLFW_PRESS) {
+            std::lock_guard<std::mutex> lock(app->camera_mutex);
             app->camera_angle_x += (xpos - last_x) * 0.01f;
             app->camera_angle_y += (ypos - last_y) * 0.01f;
+            app->governor.onInput();
         }
         
         last_x = xpos;
@@ -448,23 +6120,194 @@ public:
     
     static void scrollCallback(GLFWwindow* window, double xoffset, double yoffset) {
         RealTimeRayTracer* app = static_cast<RealTimeRayTracer*>(glfwGetWindowUserPointer(window));
+        std::lock_guard<std::mutex> lock(app->camera_mutex);
         app->camera_distance += yoffset * -0.5f;
         if (app->camera_distance < 1.0f) app->camera_distance = 1.0f;
         if (app->camera_distance > 20.0f) app->camera_distance = 20.0f;
+        app->governor.onInput();
     }
     
     static void framebufferSizeCallback(GLFWwindow* window, int width, int height) {
         RealTimeRayTracer* app = static_cast<RealTimeRayTracer*>(glfwGetWindowUserPointer(window));
-        app->width = width;
-        app->height = height;
-        app->frameBuffer.resize(width * height * 3);
         glViewport(0, 0, width, height);
+        app->input([app, width, height] {
+            app->width = width;
+            app->height = height;
+            app->resizeFrameBuffer();
+        });
     }
 };
 
-int main() {
+// Headless ray throughput of every BVH preset and traversal kernel on one thread.
+// Primary rays are coherent, diffuse bounces from the primary hits are not, and shadow
+// rays exercise the any-hit path.
+void runBenchmark(int scatter_spheres) {
+    std::vector<Sphere> spheres;
+    spheres.push_back(Sphere(Vec3(-2, 0, -5), 1.0f, Color(0.8f, 0.2f, 0.2f), 0.9f, 0.0f, 1.0f));
+    spheres.push_back(Sphere(Vec3(0, 0, -5), 1.0f, Color(0.9f, 0.9f, 0.9f), 0.0f, 0.9f, 1.52f));
+    spheres.push_back(Sphere(Vec3(2, 0, -5), 1.0f, Color(0.2f, 0.2f, 0.8f), 0.0f, 0.0f, 1.0f));
+    spheres.push_back(Sphere(Vec3(0, -101, -5), 100.0f, Color(1.0f, 1.0f, 1.0f), 0.0f, 0.0f, 1.0f));
+    scatterSpheres(spheres, scatter_spheres);
+    
+    const int width = 512, height = 384;
+    const Vec3 camera(0, 1, 5), light(0, 6, -3);
+    std::vector<Ray> primary, bounce, shadow;
+    std::vector<float> shadow_dist;
+    BVH reference;
+    reference.build(spheres, BvhPreset::Balanced, 1);
+    std::mt19937 rng(11);
+    std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+    auto primary_ray = [&](int x, int y) {
+        float u = ((x + 0.5f) / width) * 2 - 1;
+        float v = (((y + 0.5f) / height) * 2 - 1) * height / width;
+        return Ray(camera, Vec3(u, -v - 0.2f, -1));
+    };
+    for (int y = 0; y < height; ++y) {
+        for (int x = 0; x < width; ++x) {
+            primary.push_back(primary_ray(x, y));
+            float t;
+            int hit = reference.intersect(spheres, primary.back(), t);
+            if (hit < 0) continue;
+            Vec3 p = primary.back().at(t);
+            Vec3 n = spheres[hit].normal(p);
+            Vec3 origin = p + n * 0.001f;
+            bounce.push_back(Ray(origin, cosineHemisphere(n, unit(rng), unit(rng))));
+            Vec3 to_light = light - origin;
+            shadow.push_back(Ray(origin, to_light));
+            shadow_dist.push_back(sqrt(to_light.dot(to_light)));
+        }
+    }
+    
+    std::cout << "BVH benchmark: " << spheres.size() << " spheres, " << primary.size() << " primary, "
+              << bounce.size() << " bounce, " << shadow.size() << " shadow rays (Mrays/s, 1 thread)" << std::endl;
+    for (BvhPreset preset : {BvhPreset::Fast, BvhPreset::Balanced, BvhPreset::HighQuality}) {
+        BVH bvh;
+        BVH::BuildStats stats = bvh.build(spheres, preset, std::max(1u, std::thread::hardware_concurrency()));
+        std::cout << bvhPresetName(preset) << ": build " << stats.build_ms << " ms, SAH cost " << stats.sah_cost << std::endl;
+        for (BvhTraversal traversal : {BvhTraversal::Stack, BvhTraversal::ShortStack, BvhTraversal::Stackless}) {
+            bvh.traversal = traversal;
+            int checksum = 0;
+            auto throughput = [&](auto&& query, size_t count) {
+                auto start = std::chrono::high_resolution_clock::now();
+                for (size_t i = 0; i < count; ++i) checksum += query(i);
+                double seconds = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count();
+                return count / std::max(1e-9, seconds) * 1e-6;
+            };
+            float t;
+            double primary_rate = throughput([&](size_t i) { return bvh.intersect(spheres, primary[i], t); }, primary.size());
+            double bounce_rate = throughput([&](size_t i) { return bvh.intersect(spheres, bounce[i], t); }, bounce.size());
+            double shadow_rate = throughput([&](size_t i) { return (int)bvh.occluded(spheres, shadow[i], shadow_dist[i]); }, shadow.size());
+            std::cout << "  " << bvhTraversalName(traversal) << ": primary " << primary_rate << ", bounce " << bounce_rate
+                      << ", shadow " << shadow_rate << " (checksum " << checksum << ")" << std::endl;
+        }
+    }
+    
+    // Batched query API on the same rays; compare with the binned SAH stack kernel above
+    std::cout << "Query API (binned SAH, packets of " << RayPacket::kSize << " rays, Mrays/s, 1 thread)" << std::endl;
+    SceneQuery query(spheres, 1);
+    auto batch = [](const std::vector<Ray>& rays, const std::vector<float>* limits) {
+        RayBatch result;
+        for (size_t i = 0; i < rays.size(); ++i) result.push(rays[i].origin, rays[i].direction, limits ? (*limits)[i] : 1e30f);
+        return result;
+    };
+    auto rate = [](size_t count, auto&& run) {
+        auto start = std::chrono::high_resolution_clock::now();
+        run();
+        double seconds = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count();
+        return count / std::max(1e-9, seconds) * 1e-6;
+    };
+    RayBatch primary_batch = batch(primary, nullptr), bounce_batch = batch(bounce, nullptr), shadow_batch = batch(shadow, &shadow_dist);
+    SurfaceBatch hits;
+    std::vector<uint8_t> blocked;
+    double primary_rate = rate(primary.size(), [&] { query.closestHit(primary_batch, hits); });
+    double bounce_rate = rate(bounce.size(), [&] { query.closestHit(bounce_batch, hits); });
+    double shadow_rate = rate(shadow.size(), [&] { query.anyHit(shadow_batch, blocked); });
+    std::cout << "  closest hit: primary " << primary_rate << ", bounce " << bounce_rate << "; any hit: shadow " << shadow_rate << std::endl;
+    
+    // Work order: the plain row loop against the tile scheduler in each curve order. Every
+    // pixel traces its primary ray and, on a hit, a shadow ray, generated in visiting order.
+    std::cout << "Pixel order (binned SAH, primary + shadow, Mrays/s, 1 thread)" << std::endl;
+    reference.traversal = BvhTraversal::Stack;
+    int traced = 0, checksum = 0;
+    auto shade = [&](int x, int y) {
+        Ray ray = primary_ray(x, y);
+        float t;
+        int hit = reference.intersect(spheres, ray, t);
+        ++traced;
+        if (hit < 0) return;
+        Vec3 origin = ray.at(t) + spheres[hit].normal(ray.at(t)) * 0.001f;
+        Vec3 to_light = light - origin;
+        checksum += hit + reference.occluded(spheres, Ray(origin, to_light), sqrt(to_light.dot(to_light)));
+        ++traced;
+    };
+    auto report = [&](const char* name, auto&& frame) {
+        traced = 0;
+        auto start = std::chrono::high_resolution_clock::now();
+        frame();
+        double seconds = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count();
+        std::cout << "  " << name << ": " << traced / std::max(1e-9, seconds) * 1e-6 << " (checksum " << checksum << ")" << std::endl;
+        checksum = 0;
+    };
+    report("rows", [&] {
+        for (int y = 0; y < height; ++y)
+            for (int x = 0; x < width; ++x) shade(x, y);
+    });
+    for (PixelOrder order : {PixelOrder::Scanline, PixelOrder::Morton, PixelOrder::Hilbert}) {
+        TileScheduler scheduler;
+        scheduler.order = order;
+        std::string name = std::string(pixelOrderName(order)) + " tiles";
+        report(name.c_str(), [&] {
+            scheduler.run(width, height, 1, [&](const Tile& tile) { scheduler.forEachPixel(tile, shade); });
+        });
+    }
+}
+
+int main(int argc, char** argv) {
+    LaunchOptions options;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--spheres" && i + 1 < argc) options.scatter_spheres = std::max(0, atoi(argv[++i]));
+        else if (arg == "--threads" && i + 1 < argc) options.threads = std::max(0, atoi(argv[++i]));
+        else if (arg == "--seed" && i + 1 < argc) options.seed = (uint32_t)strtoul(argv[++i], nullptr, 10);
+        else if (arg == "--benchmark") options.benchmark = true;
+        else if (arg == "--console") options.console = true;
+        else if (arg == "--tune") options.tune = true;
+        else if (arg == "--memory-budget" && i + 1 < argc) {
+            if (!memoryStats().setBudget(argv[++i])) std::cerr << "Ignoring memory budget " << argv[i] << " (expected frame|texture|accel|cache=MB)" << std::endl;
+        }
+        else if (arg == "--scene" && i + 1 < argc) options.scene_path = argv[++i];
+        else if (arg == "--thumbnails" && i + 1 < argc) options.thumbnails = std::max(0, atoi(argv[++i]));
+        else if (arg == "--spp" && i + 1 < argc) options.thumbnail_samples = std::max(1, atoi(argv[++i]));
+        else if (arg == "--size" && i + 1 < argc) {
+            int w = 0, h = 0;
+            if (sscanf(argv[++i], "%dx%d", &w, &h) == 2 && w > 0 && h > 0) {
+                options.thumbnail_width = w;
+                options.thumbnail_height = h;
+            }
+        }
+    }
+    
+    if (options.benchmark) {
+        runBenchmark(options.scatter_spheres > 0 ? options.scatter_spheres : 100000);
+        return 0;
+    }
+    
+    if (options.thumbnails > 0) {
+        options.headless = true;
+        RealTimeRayTracer raytracer(options.thumbnail_width, options.thumbnail_height, options);
+        raytracer.renderThumbnails(options.thumbnails, options.thumbnail_width, options.thumbnail_height, options.thumbnail_samples);
+        return 0;
+    }
+    
+    if (options.tune) {
+        options.headless = true;
+        RealTimeRayTracer raytracer(1600, 1200, options);
+        raytracer.autoTune();
+        return 0;
+    }
+    
     try {
-        RealTimeRayTracer raytracer(1600, 1200); 
+        RealTimeRayTracer raytracer(1600, 1200, options); 
         raytracer.run();
     } catch (const std::exception& e) {
         std::cerr << "Error: " << e.what() << std::endl;